@@ -1,31 +1,58 @@
+#include <assert.h>
 #include <stdio.h>
 #include <bsp/board_api.h>
 #include <tusb.h>
+#include <device/usbd_pvt.h>
 
 #include "pico/stdlib.h"
 #include "hardware/uart.h"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
 
 #include "pico/time.h"
 #include "ws2812.pio.h"
 
-typedef struct {
-	uint8_t index;
-	uint8_t format;
-} vendor_ctrl_chan_cfg_t;
+#include "pixelpusher.h"
+#include "pp_convert.h"
+#include "pp_sched.h"
 
-#define PP_FORMAT_UNSET	0x0
-#define PP_FORMAT_RGB	0x1
-#define PP_FORMAT_RGBW	0x2
+#if PP_ISO_STREAM
+#include "pp_iso.h"
+#endif
 
-#define PP_VENDOR_CTRL_REQ_CFG_CHAN 0x1
+#if PP_OUTPUT_HSTX
+#include "pp_hstx.h"
+#endif
 
-#define PIXDATA_BUFSZ 4096
+#define PP_VENDOR_CTRL_REQ_CFG_CHAN 0x1
+#define PP_VENDOR_CTRL_REQ_GET_STATS 0x2
+#define PP_VENDOR_CTRL_REQ_GET_CAPS 0x3
+#define PP_VENDOR_CTRL_REQ_SET_CLOCK 0x4
+#define PP_VENDOR_CTRL_REQ_GET_CHAN_STATS 0x5
+#define PP_VENDOR_CTRL_REQ_GET_BOOT_TIMES 0x6
+#define PP_VENDOR_CTRL_REQ_GET_JOB_STATS 0x7
+
+/* Times a frame that underran is sent again, 0 to only count underruns */
+#ifndef PP_UNDERRUN_RETRIES
+#define PP_UNDERRUN_RETRIES 1
+#endif
+
+/* One link of a channel's DMA chain, in the order of the data channel's
+ * alias 3 registers that the control channel writes it to */
+typedef struct {
+	uint32_t len;
+	uint8_t const *addr;
+} pp_dma_desc_t;
 
 typedef struct {
 	vendor_ctrl_chan_cfg_t cfg;
 	bool configured;
+	/* Copies host data into buf in the strip's wire format */
+	pp_convert_fn_t convert;
+	uint8_t Bpp;
 	/* PIO */
 	PIO pio;
 	uint sm;
@@ -33,52 +60,274 @@ typedef struct {
 	/* DMA */
 	alarm_id_t xfer_finished_delay_alarm;
 	struct semaphore xfer_finished_sem;
-	/* Buffer */
-	uint8_t buf[PIXDATA_BUFSZ];
+	uint16_t xfer_len;
+	absolute_time_t fifo_idle_at;
+	bool underrun;
+	uint8_t retries;
+	pp_chan_stats_t stats;
+	/* Buffer, as blocks from the pool, and the chain that outputs it.
+	 * The chain ends with a null trigger. */
+	uint8_t *blocks[PP_CHAN_MAX_BLOCKS];
+	uint8_t num_blocks;
+	pp_dma_desc_t descs[PP_CHAN_MAX_BLOCKS + 1];
 } pp_channel_t;
 
-#define NUM_CHANNELS 8
+/* Channels are split evenly between the vendor interfaces, so each group
+ * of channels has its own pair of bulk endpoints and the host can keep a
+ * transfer in flight on every group at once. */
+#define PP_CHANNELS_PER_ITF (NUM_CHANNELS / CFG_TUD_VENDOR)
+
+#if NUM_CHANNELS % CFG_TUD_VENDOR
+#error "NUM_CHANNELS must be a multiple of CFG_TUD_VENDOR"
+#endif
 
 static pp_channel_t pp_channels[NUM_CHANNELS];
 
-static bool pp_pio_deinit(uint8_t index);
-static bool pp_dma_deinit(uint8_t index);
+static pp_dev_stats_t pp_stats;
+
+static pp_boot_times_t pp_boot;
+
+/* Record the first time a boot phase is reached */
+#define PP_BOOT_MARK(phase) \
+	do { if (!pp_boot.phase) pp_boot.phase = time_us_32(); } while (0)
+
+/* Set while PP_BOOT_CHANNELS are brought up. Blocking UART output then
+ * would hold up tud_task() while the host enumerates, so the boot log job
+ * reports those channels once the device is mounted instead. */
+static bool pp_log_quiet;
+
+/* For messages on paths that PP_BOOT_CHANNELS go through */
+#define PP_LOG(...) \
+	do { if (!pp_log_quiet) printf(__VA_ARGS__); } while (0)
+
+/**
+ * Buffer pool
+ *
+ * Every block is the same size, so the pool can't fragment: a channel
+ * can always grow as long as enough blocks are free in total, however
+ * often channels have been resized before.
+ */
+
+#ifndef PP_POOL_BLOCKS
+#define PP_POOL_BLOCKS (NUM_CHANNELS * PP_CHAN_MAX_BLOCKS)
+#endif
+
+#if PP_POOL_BLOCKS > 255
+#error "PP_POOL_BLOCKS must fit block indices in a uint8_t"
+#endif
+
+static uint8_t pp_pool[PP_POOL_BLOCKS][PP_BLOCK_SIZE];
+
+/* Stack of free block indices */
+static uint8_t pp_pool_free[PP_POOL_BLOCKS];
+static uint8_t pp_pool_num_free;
+
+static void pp_pool_init(void)
+{
+	uint8_t block;
+
+	for (block = 0; block < PP_POOL_BLOCKS; block++)
+		pp_pool_free[block] = block;
+	pp_pool_num_free = PP_POOL_BLOCKS;
+}
+
+/* Grow or shrink a channel's buffer to hold bytes, 0 frees it all. The
+ * channel must be idle. Fails, leaving the buffer as it was, if the
+ * pool is short of blocks. */
+static bool pp_chan_resize(pp_channel_t *chan, uint16_t bytes)
+{
+	uint8_t want = (bytes + PP_BLOCK_SIZE - 1) / PP_BLOCK_SIZE;
+	uint8_t block;
+
+	if (want > PP_CHAN_MAX_BLOCKS ||
+	    want > pp_pool_num_free + chan->num_blocks) {
+		PP_LOG("No room for %d bytes on channel %d, %d blocks free\n",
+			bytes, chan->cfg.index, pp_pool_num_free);
+		return false;
+	}
+
+	while (chan->num_blocks > want) {
+		block = (chan->blocks[--chan->num_blocks] - pp_pool[0]) / PP_BLOCK_SIZE;
+		pp_pool_free[pp_pool_num_free++] = block;
+	}
+
+	while (chan->num_blocks < want) {
+		block = pp_pool_free[--pp_pool_num_free];
+		chan->blocks[chan->num_blocks++] = pp_pool[block];
+	}
+
+	if (chan->xfer_len > bytes)
+		chan->xfer_len = bytes;
+
+	return true;
+}
+
+/* Blank the whole buffer, so the first patch after a channel is set up
+ * or reconfigured outputs dark pixels around it rather than whatever an
+ * earlier channel or layout left in the blocks */
+static void pp_chan_clear(pp_channel_t *chan)
+{
+	uint8_t block;
+
+	for (block = 0; block < chan->num_blocks; block++)
+		memset(chan->blocks[block], 0, PP_BLOCK_SIZE);
+}
+
+/* Bytes in a whole frame for the channel's configuration */
+static uint16_t pp_chan_frame_len(pp_channel_t const *chan)
+{
+	return chan->cfg.pixels * chan->Bpp;
+}
+
+/* Convert host data into the buffer from byte offset on. Blocks hold a
+ * whole number of pixels, so as long as offset is on a pixel boundary a
+ * kernel never sees one split. */
+static void pp_chan_convert(pp_channel_t *chan, uint16_t offset,
+	uint8_t const *data, uint16_t len)
+{
+	uint8_t block = offset / PP_BLOCK_SIZE;
+	uint16_t pos = offset % PP_BLOCK_SIZE;
+	uint16_t n;
+
+	for (; len; block++, pos = 0) {
+		n = PP_BLOCK_SIZE - pos;
+		if (n > len)
+			n = len;
+		chan->convert(chan->blocks[block] + pos, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+static bool pp_output_init(uint8_t index);
+static void pp_output_deinit(uint8_t index);
+static struct semaphore *pp_output_sem(pp_channel_t *chan);
+static void pp_output_drain(pp_channel_t *chan);
+
+static void pp_release_channel(uint8_t index)
+{
+	pp_channel_t *chan = &pp_channels[index];
+
+	if (!chan->configured)
+		return;
+
+	/* Let the frame in flight finish and latch before tearing down */
+	sem_acquire_blocking(pp_output_sem(chan));
+	pp_output_drain(chan);
+	chan->configured = false;
+
+	pp_output_deinit(index);
+	pp_chan_resize(chan, 0);
+	sem_release(pp_output_sem(chan));
+
+	printf("Released channel %d\n", index);
+}
 
-static bool pp_init_channel(uint8_t index, uint8_t format)
+static bool pp_init_channel(vendor_ctrl_chan_cfg_t const *req)
 {
 	bool success = true;
 	vendor_ctrl_chan_cfg_t *cfg;
 	pp_channel_t *chan;
+	pp_convert_fn_t convert;
+	uint8_t index = req->index;
 	uint8_t Bpp;
-	uint16_t bytes;
+	uint32_t bytes;
 
-	switch (format) {
+	/* Both host requests and PP_BOOT_CHANNELS come through here */
+	if (index >= NUM_CHANNELS) {
+		PP_LOG("Invalid channel index %d\n", index);
+		success = false;
+		goto out;
+	}
+
+	chan = &pp_channels[index];
+
+	/* An unset format removes the channel from the table */
+	if (req->format == PP_FORMAT_UNSET) {
+		pp_release_channel(index);
+		goto out;
+	}
+
+	switch (req->format) {
 		case PP_FORMAT_RGB: Bpp = 3; break;
 		case PP_FORMAT_RGBW: Bpp = 4; break;
 		default: success = false; goto out;
 	}
 
-	chan = &pp_channels[index];
+	/* A channel with no pixels would reject every write */
+	bytes = (uint32_t)req->pixels * Bpp;
+	if (bytes == 0 || bytes > PIXDATA_BUFSZ) {
+		success = false;
+		goto out;
+	}
 
-	if (chan->configured) {
-		pp_pio_deinit(index);
-		pp_dma_deinit(index);
+	/* Bind the kernel specialised for this format and colour order */
+	convert = pp_convert_lookup(req->format, req->order);
+	if (convert == NULL) {
+		success = false;
+		goto out;
 	}
 
 	cfg = &chan->cfg;
-	cfg->index = index;
-	cfg->format = format;
-	chan->configured = true;
 
-	printf("Configuring channel %d\n", cfg->index);
+	if (chan->configured) {
+		if (cfg->format == req->format && cfg->pixels == req->pixels &&
+		    cfg->order == req->order)
+			goto out;
+
+		/* The PIO program and DMA channel don't depend on the pixel
+		 * format, so leave them running and swap the config in between
+		 * frames: the frame in flight finishes with the old config and
+		 * the next one uses the new one, without dropping either. The
+		 * buffer is resized in the same gap. */
+		sem_acquire_blocking(pp_output_sem(chan));
+		pp_output_drain(chan);
+		success = pp_chan_resize(chan, bytes);
+		if (success) {
+			*cfg = *req;
+			chan->convert = convert;
+			chan->Bpp = Bpp;
+			pp_chan_clear(chan);
+		}
+		sem_release(pp_output_sem(chan));
+
+		if (success)
+			printf("Reconfigured channel %d\n", cfg->index);
+		goto out;
+	}
+
+	*cfg = *req;
+	chan->convert = convert;
+	chan->Bpp = Bpp;
+
+	PP_LOG("Configuring channel %d\n", cfg->index);
+
+	success = pp_chan_resize(chan, bytes);
+	if (!success) goto out;
+
+	pp_chan_clear(chan);
+
+	success = pp_output_init(index);
+	if (!success) {
+		pp_chan_resize(chan, 0);
+		goto out;
+	}
+
+	chan->configured = true;
 
 out:
-	if (!success) printf("Failed to configure PIO\n");
+	if (!success) PP_LOG("Failed to configure PIO\n");
 	return success;
 }
 
+#define PP_RESET_TIME_US (320)  /* WS2815B minimum reset time determined experimentally */
+
+#if !PP_OUTPUT_HSTX
+
 #define PP_GPIO_PIN_OFFSET 3
 
+#define PP_WS2812_FREQ 800000
+
 static bool pp_pio_init(uint8_t index)
 {
 	bool success = true;
@@ -91,15 +340,15 @@ static bool pp_pio_init(uint8_t index)
 		&ws2812_program, &chan->pio, &chan->sm,
 		&chan->offset, pin, 1, true);
 	if (!success) {
-		printf("Failed calling pio_claim_free_sm_and_"
+		PP_LOG("Failed calling pio_claim_free_sm_and_"
 			"add_program_for_gpio_range: pin %d, pio %s\n",
 			pin, chan->pio == NULL ? "unavailble" : "available");
 		goto out;
 	}
 
-	printf("Configured PIO at %p for pin %d sm %d offset %d\n", chan->pio, pin, chan->sm, chan->offset);
+	PP_LOG("Configured PIO at %p for pin %d sm %d offset %d\n", chan->pio, pin, chan->sm, chan->offset);
 
-	ws2812_program_init(chan->pio, chan->sm, chan->offset, pin, 800000);
+	ws2812_program_init(chan->pio, chan->sm, chan->offset, pin, PP_WS2812_FREQ);
 
 out:
 	return success;
@@ -112,7 +361,55 @@ static bool pp_pio_deinit(uint8_t index)
 	if (chan->pio != NULL) {
 		pio_remove_program_and_unclaim_sm(&ws2812_program,
 			chan->pio, chan->sm, chan->offset);
+		chan->pio = NULL;
+	}
+
+	return true;
+}
+
+/* Control channel that walks a data channel's descriptor chain.
+ * ASSUMPTION: as with the data channels, we own these outright. */
+#define PP_DMA_CTRL_CHAN(index) ((index) + NUM_CHANNELS)
+
+#if 2 * NUM_CHANNELS > NUM_DMA_CHANNELS
+#error "Not enough DMA channels for a data and control channel per output"
+#endif
+
+static void pp_dma_start(pp_channel_t *chan, uint16_t len)
+{
+	uint8_t index = chan->cfg.index;
+	uint32_t irq_state;
+	uint16_t remain;
+	uint8_t block;
+
+	chan->xfer_len = len;
+
+	for (block = 0, remain = len; remain; block++) {
+		chan->descs[block].len = dma_encode_transfer_count(
+			remain < PP_BLOCK_SIZE ? remain : PP_BLOCK_SIZE);
+		chan->descs[block].addr = chan->blocks[block];
+		remain -= remain < PP_BLOCK_SIZE ? remain : PP_BLOCK_SIZE;
 	}
+	chan->descs[block].len = 0;
+	chan->descs[block].addr = NULL;
+
+	/* The idle state machine is stalled on its empty FIFO, so its stall
+	 * flag is already set. Clear it once the FIFO has data to work
+	 * through; a stall seen when the DMA completes then happened part
+	 * way through the frame. Interrupts are held off so the DMA
+	 * completion can't be handled before the clear. */
+	irq_state = save_and_disable_interrupts();
+
+	dma_channel_set_read_addr(PP_DMA_CTRL_CHAN(index), chan->descs, true);
+
+	while (!pio_sm_is_tx_fifo_full(chan->pio, chan->sm) &&
+	       (dma_channel_is_busy(index) ||
+		dma_channel_is_busy(PP_DMA_CTRL_CHAN(index))))
+		tight_loop_contents();
+
+	chan->pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + chan->sm);
+
+	restore_interrupts(irq_state);
 }
 
 static int64_t pp_reset_delay_complete(alarm_id_t id, void *user_data)
@@ -120,13 +417,29 @@ static int64_t pp_reset_delay_complete(alarm_id_t id, void *user_data)
 	pp_channel_t *chan = (pp_channel_t *)user_data;
 
 	chan->xfer_finished_delay_alarm = 0;
-	sem_release(&chan->xfer_finished_sem);
+
+	/* The strip has latched a truncated frame, send the whole frame
+	 * again now the latch gap has passed */
+	if (chan->underrun && chan->retries) {
+		chan->underrun = false;
+		chan->retries--;
+		chan->stats.retransmits++;
+		pp_dma_start(chan, chan->xfer_len);
+		return 0;
+	}
+
+	chan->underrun = false;
+	chan->stats.frames++;
+	pp_stats.frames++;
+
+	/* The semaphore is only ever taken by a write, so it being free
+	 * here means a release happened without a matching transfer */
+	if (!sem_release(&chan->xfer_finished_sem))
+		pp_stats.sem_errors++;
 
 	return 0;
 }
 
-#define PP_RESET_TIME_US (320)  /* WS2815B minimum reset time determined experimentally */
-
 void pp_dma_complete_channel(uint8_t channel)
 {
 	/* ASSUMPTION: DMA channel number is output channel index */
@@ -134,6 +447,14 @@ void pp_dma_complete_channel(uint8_t channel)
 
 	dma_hw->ints0 = 1 << channel;
 
+	/* The FIFO still holds the last few bytes of the frame, so the state
+	 * machine can only have stalled if it ran dry mid-frame. A WS2812
+	 * takes that gap as a reset and latches a truncated frame. */
+	if (chan->pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + chan->sm))) {
+		chan->underrun = true;
+		chan->stats.underruns++;
+	}
+
 	/* If there's already an end-of-transfer delay
 	 * alarm running, cancel it... */
 	if (chan->xfer_finished_delay_alarm != 0) {
@@ -145,6 +466,16 @@ void pp_dma_complete_channel(uint8_t channel)
 	chan->xfer_finished_delay_alarm = add_alarm_in_us(PP_RESET_TIME_US,
 		pp_reset_delay_complete, chan, true);
 
+	/* Out of alarms: release now rather than leave the channel, and any
+	 * write blocked on it, stuck forever. The latch gap may be short for
+	 * this one frame, so don't retransmit: a resend would run straight
+	 * on from the truncated frame rather than replace it. */
+	if (chan->xfer_finished_delay_alarm < 0) {
+		pp_stats.alarm_failures++;
+		chan->retries = 0;
+		pp_reset_delay_complete(0, chan);
+	}
+
 	return;
 }
 
@@ -168,6 +499,7 @@ void pp_dma_complete_handler(void)
 static bool pp_dma_init(uint8_t index)
 {
 	bool success = true;
+	dma_channel_config ctrl_config;
 
 	pp_channel_t *chan = &pp_channels[index];
 
@@ -176,6 +508,7 @@ static bool pp_dma_init(uint8_t index)
 	 * channel number, rather than claiming and unclaiming DMA channels
 	 * as required. */
 	dma_channel_claim(index);
+	dma_channel_claim(PP_DMA_CTRL_CHAN(index));
 	dma_channel_config channel_config = dma_channel_get_default_config(index);
 
 	configured_dma_mask |= (1 << index);
@@ -186,27 +519,481 @@ static bool pp_dma_init(uint8_t index)
 	channel_config_set_read_increment(&channel_config, true);
 	channel_config_set_write_increment(&channel_config, false);
 	channel_config_set_write_address_update_type(&channel_config, DMA_ADDRESS_UPDATE_NONE);
-	channel_config_set_chain_to(&channel_config, index);
+	/* Hand back to the control channel after each block. It only
+	 * interrupts on the null trigger that ends the chain. */
+	channel_config_set_chain_to(&channel_config, PP_DMA_CTRL_CHAN(index));
+	channel_config_set_irq_quiet(&channel_config, true);
 	dma_channel_configure(index, &channel_config, &chan->pio->txf[chan->sm],
                         NULL, 0, false);
+
+	/* Control channel writes each pp_dma_desc_t to the data channel's
+	 * transfer count and read address trigger, wrapping every 8 bytes */
+	ctrl_config = dma_channel_get_default_config(PP_DMA_CTRL_CHAN(index));
+	channel_config_set_transfer_data_size(&ctrl_config, DMA_SIZE_32);
+	channel_config_set_read_increment(&ctrl_config, true);
+	channel_config_set_write_increment(&ctrl_config, true);
+	channel_config_set_ring(&ctrl_config, true, 3);
+	dma_channel_configure(PP_DMA_CTRL_CHAN(index), &ctrl_config,
+		&dma_hw->ch[index].al3_transfer_count, NULL, 2, false);
 	irq_set_exclusive_handler(DMA_IRQ_0, pp_dma_complete_handler);
 	dma_channel_set_irq0_enabled(index, true);
 	irq_set_enabled(DMA_IRQ_0, true);
 
 	sem_init(&chan->xfer_finished_sem, 1, 1);
 
-	printf("Configured DMA %d\n", index);
+	PP_LOG("Configured DMA %d\n", index);
 
 	return success;
 }
 
 static bool pp_dma_deinit(uint8_t index)
 {
-	pp_channel_t *chan = &pp_channels[index];
-
+	dma_channel_cleanup(PP_DMA_CTRL_CHAN(index));
 	dma_channel_cleanup(index);
 	configured_dma_mask &= ~(1 << index);
+	dma_channel_unclaim(PP_DMA_CTRL_CHAN(index));
 	dma_channel_unclaim(index);
+
+	return true;
+}
+
+/**
+ * FIFO direct output
+ *
+ * A frame that fits in the joined TX FIFO is written straight into it by
+ * the CPU: no DMA, interrupt, alarm or semaphore. The channel is idle
+ * again once the state machine has stalled on the empty FIFO and the
+ * frame's bit time plus the latch gap has passed.
+ *
+ * Writes only come from the main loop, so nothing can start a frame on
+ * the channel between a direct write checking it's idle and starting.
+ */
+
+/* Joined TX FIFO depth, with the 8 bit pull threshold one byte per entry */
+#define PP_FIFO_DIRECT_MAX 8
+
+static bool pp_fifo_idle(pp_channel_t *chan)
+{
+	if (!pio_sm_is_tx_fifo_empty(chan->pio, chan->sm))
+		return false;
+
+	/* Stalled pulling, so the last bit is out and the line is low */
+	if (!(chan->pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + chan->sm))))
+		return false;
+
+	return time_reached(chan->fifo_idle_at);
+}
+
+static void pp_fifo_start(pp_channel_t *chan, uint16_t len)
+{
+	uint8_t const *buf = chan->blocks[0];
+	uint32_t irq_state;
+	uint16_t i;
+
+	/* A gap between bytes would latch a truncated frame */
+	irq_state = save_and_disable_interrupts();
+
+	for (i = 0; i < len; i++)
+		pio_sm_put(chan->pio, chan->sm, (uint32_t)buf[i] << 24);
+
+	/* The state machine took the first byte straight away, so the stall
+	 * flag is only set again once the whole frame is out */
+	chan->pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + chan->sm);
+
+	/* Counted on start, there's no completion to count it on. The latch
+	 * alarm counts DMA frames from its IRQ, so this has to be done with
+	 * interrupts off too. */
+	chan->stats.frames++;
+	pp_stats.frames++;
+
+	restore_interrupts(irq_state);
+
+	chan->xfer_len = len;
+	chan->fifo_idle_at = make_timeout_time_us(
+		len * 8 * 1000000u / PP_WS2812_FREQ + PP_RESET_TIME_US);
+
+	PP_BOOT_MARK(first_frame_us);
+}
+
+static bool pp_fifo_write(pp_channel_t *chan, uint16_t offset,
+	uint8_t const *data, uint16_t len, uint16_t out_len, bool block)
+{
+	uint32_t start = time_us_32();
+	uint32_t wait;
+
+	/* The semaphore is only taken from the main loop, so it being free
+	 * means no DMA frame is sending or latching */
+	while (!sem_available(&chan->xfer_finished_sem) || !pp_fifo_idle(chan)) {
+		if (!block)
+			return false;
+		tight_loop_contents();
+	}
+
+	wait = time_us_32() - start;
+	if (wait > pp_stats.max_wait_us)
+		pp_stats.max_wait_us = wait;
+
+	pp_chan_convert(chan, offset, data, len);
+	pp_fifo_start(chan, out_len);
+
+	return true;
+}
+
+#endif /* !PP_OUTPUT_HSTX */
+
+/**
+ * Output engine
+ *
+ * By default each channel has its own PIO state machine and DMA channel,
+ * and its semaphore is held from a write until that frame has latched.
+ * With PP_OUTPUT_HSTX every channel is instead a lane of the HSTX
+ * serialiser, and all lanes go out together as one frame. Writes only
+ * fill their channel's buffer and post the present job, so writes to
+ * several channels that arrive together are output together, and a
+ * single semaphore is held while a frame is going out.
+ */
+
+#if PP_OUTPUT_HSTX
+
+#if NUM_CHANNELS > PP_HSTX_LANES
+#error "NUM_CHANNELS must not exceed PP_HSTX_LANES"
+#endif
+
+static struct semaphore pp_hstx_sem;
+
+/* Set once the serialiser and its DMA channels are set up */
+static bool pp_hstx_ready;
+
+/* Channels written since the last frame, and those in the frame going out */
+static uint8_t pp_hstx_dirty;
+static uint8_t pp_hstx_sent;
+
+/* Deadline for starting output once a channel has been written */
+#define PP_PRESENT_DEADLINE_US 1000
+
+static void pp_hstx_frame_done(void)
+{
+	uint8_t index;
+
+	for (index = 0; index < NUM_CHANNELS; index++) {
+		if (pp_hstx_sent & (1u << index)) {
+			pp_channels[index].stats.frames++;
+			pp_stats.frames++;
+		}
+	}
+
+	if (!sem_release(&pp_hstx_sem))
+		pp_stats.sem_errors++;
+}
+
+static pp_job_t pp_present_job;
+
+static void pp_hstx_present(void *arg)
+{
+	uint8_t *const *bufs[PP_HSTX_LANES] = {0};
+	uint16_t lens[PP_HSTX_LANES] = {0};
+	pp_channel_t *chan;
+	uint8_t index;
+
+	(void) arg;
+
+	/* Never wait here for a frame in flight, that would hold up
+	 * tud_task() for the whole frame. Try again later instead. */
+	if (!sem_try_acquire(&pp_hstx_sem)) {
+		pp_sched_post(&pp_present_job, PP_PRESENT_DEADLINE_US);
+		return;
+	}
+
+	if (!pp_hstx_dirty) {
+		sem_release(&pp_hstx_sem);
+		return;
+	}
+
+	/* Channels that weren't written repeat their last frame */
+	for (index = 0; index < NUM_CHANNELS; index++) {
+		chan = &pp_channels[index];
+		if (!chan->configured)
+			continue;
+
+		bufs[index] = chan->blocks;
+		lens[index] = chan->xfer_len;
+	}
+
+	pp_hstx_sent = pp_hstx_dirty;
+	pp_hstx_dirty = 0;
+
+	pp_hstx_start(bufs, lens, pp_hstx_frame_done);
+}
+
+static pp_job_t pp_present_job = {
+	.name = "present",
+	.fn = pp_hstx_present,
+	.priority = 0,
+};
+
+static void pp_output_engine_init(void)
+{
+	sem_init(&pp_hstx_sem, 1, 1);
+	pp_hstx_ready = pp_hstx_init(PP_RESET_TIME_US);
+	pp_sched_add(&pp_present_job);
+}
+
+static bool pp_output_init(uint8_t index)
+{
+	/* Reported on every attempt, not just once at boot */
+	if (!pp_hstx_ready) {
+		PP_LOG("HSTX output unavailable, can't configure channel %d\n", index);
+		return false;
+	}
+
+	pp_channels[index].xfer_len = 0;
+	pp_hstx_lane_init(index);
+
+	return true;
+}
+
+static void pp_output_deinit(uint8_t index)
+{
+	pp_hstx_lane_deinit(index);
+}
+
+static struct semaphore *pp_output_sem(pp_channel_t *chan)
+{
+	(void) chan;
+
+	return &pp_hstx_sem;
+}
+
+static void pp_output_drain(pp_channel_t *chan)
+{
+	(void) chan;
+}
+
+/* A write would have to wait for the frame going out */
+static bool pp_output_busy(pp_channel_t *chan)
+{
+	(void) chan;
+
+	return !sem_available(&pp_hstx_sem);
+}
+
+/* Called with the semaphore held and buf filled */
+static void pp_output_start(pp_channel_t *chan, uint16_t len)
+{
+	chan->xfer_len = len;
+	pp_hstx_dirty |= 1u << chan->cfg.index;
+
+	sem_release(&pp_hstx_sem);
+	pp_sched_post(&pp_present_job, PP_PRESENT_DEADLINE_US);
+}
+
+static bool pp_output_hold_all(void)
+{
+	return sem_try_acquire(&pp_hstx_sem);
+}
+
+static void pp_output_release_all(void)
+{
+	sem_release(&pp_hstx_sem);
+}
+
+static void pp_output_retune(void)
+{
+	/* clk_hstx runs from pll_usb, which clock profiles leave alone */
+}
+
+#else
+
+static void pp_output_engine_init(void)
+{
+}
+
+static bool pp_output_init(uint8_t index)
+{
+	return pp_pio_init(index) && pp_dma_init(index);
+}
+
+static void pp_output_deinit(uint8_t index)
+{
+	pp_pio_deinit(index);
+	pp_dma_deinit(index);
+}
+
+static struct semaphore *pp_output_sem(pp_channel_t *chan)
+{
+	return &chan->xfer_finished_sem;
+}
+
+/* Wait out a frame written straight to the FIFO. Called with the
+ * semaphore held, before anything else touches the state machine. */
+static void pp_output_drain(pp_channel_t *chan)
+{
+	while (!pp_fifo_idle(chan))
+		tight_loop_contents();
+}
+
+/* A write would have to wait for a frame to send and latch */
+static bool pp_output_busy(pp_channel_t *chan)
+{
+	return !sem_available(&chan->xfer_finished_sem) || !pp_fifo_idle(chan);
+}
+
+/* Called with the semaphore held and buf filled */
+static void pp_output_start(pp_channel_t *chan, uint16_t len)
+{
+	chan->retries = PP_UNDERRUN_RETRIES;
+	pp_dma_start(chan, len);
+}
+
+/* Take every active channel between frames, or none if any is busy */
+static bool pp_output_hold_all(void)
+{
+	pp_channel_t *chan;
+	uint8_t index, taken;
+
+	for (index = 0; index < NUM_CHANNELS; index++) {
+		chan = &pp_channels[index];
+		if (!chan->configured)
+			continue;
+
+		if (!sem_try_acquire(&chan->xfer_finished_sem))
+			break;
+
+		/* A direct frame may still be going out */
+		if (!pp_fifo_idle(chan)) {
+			sem_release(&chan->xfer_finished_sem);
+			break;
+		}
+	}
+
+	if (index == NUM_CHANNELS)
+		return true;
+
+	for (taken = 0; taken < index; taken++) {
+		if (pp_channels[taken].configured)
+			sem_release(&pp_channels[taken].xfer_finished_sem);
+	}
+
+	return false;
+}
+
+static void pp_output_release_all(void)
+{
+	uint8_t index;
+
+	for (index = 0; index < NUM_CHANNELS; index++) {
+		if (pp_channels[index].configured)
+			sem_release(&pp_channels[index].xfer_finished_sem);
+	}
+}
+
+static void pp_output_retune(void)
+{
+	pp_channel_t *chan;
+	uint8_t index;
+
+	for (index = 0; index < NUM_CHANNELS; index++) {
+		chan = &pp_channels[index];
+		if (chan->configured)
+			ws2812_program_set_freq(chan->pio, chan->sm, PP_WS2812_FREQ);
+	}
+}
+
+#endif /* PP_OUTPUT_HSTX */
+
+/**
+ * Clock profiles
+ */
+
+typedef struct {
+	uint32_t sys_khz;
+	enum vreg_voltage vreg;
+} pp_clock_profile_t;
+
+static const pp_clock_profile_t pp_clock_profiles[PP_CLOCK_PROFILE_COUNT] = {
+	[PP_CLOCK_PROFILE_LOW]		= { 100000, VREG_VOLTAGE_DEFAULT },
+	[PP_CLOCK_PROFILE_DEFAULT]	= { 150000, VREG_VOLTAGE_DEFAULT },
+	[PP_CLOCK_PROFILE_FAST]		= { 200000, VREG_VOLTAGE_1_15 },
+};
+
+#define PP_VREG_SETTLE_US 1000
+
+static uint8_t pp_clock_profile = PP_CLOCK_PROFILE_DEFAULT;
+static uint8_t pp_clock_requested = PP_CLOCK_PROFILE_DEFAULT;
+
+/* Deadline for starting a profile switch once requested */
+#define PP_CLOCK_DEADLINE_US 10000
+
+static pp_job_t pp_clock_job;
+
+static void pp_clock_apply(void *arg)
+{
+	uint8_t profile = pp_clock_requested;
+	const pp_clock_profile_t *from = &pp_clock_profiles[pp_clock_profile];
+	const pp_clock_profile_t *to = &pp_clock_profiles[profile];
+	bool success;
+
+	(void) arg;
+
+	if (profile == pp_clock_profile)
+		return;
+
+	/* Hold every active channel between frames so no output is part
+	 * way through a frame while clk_sys moves under it. Never wait for
+	 * one here, that would hold up tud_task(); try again later instead. */
+	if (!pp_output_hold_all()) {
+		pp_sched_post(&pp_clock_job, PP_CLOCK_DEADLINE_US);
+		return;
+	}
+
+	/* Raise the core voltage before the clock, lower it after */
+	if (to->vreg > from->vreg) {
+		vreg_set_voltage(to->vreg);
+		busy_wait_us(PP_VREG_SETTLE_US);
+	}
+
+	success = set_sys_clock_khz(to->sys_khz, false);
+
+	if (success && to->vreg < from->vreg)
+		vreg_set_voltage(to->vreg);
+	else if (!success && to->vreg > from->vreg)
+		vreg_set_voltage(from->vreg);
+
+	if (success)
+		pp_clock_profile = profile;
+	else
+		pp_clock_requested = pp_clock_profile;
+
+#ifdef uart_default
+	/* clk_peri follows clk_sys, so the UART divider needs redoing too */
+	uart_set_baudrate(uart_default, PICO_DEFAULT_UART_BAUD_RATE);
+#endif
+
+	pp_output_retune();
+	pp_output_release_all();
+
+	printf("Clock profile %d %s, clk_sys %lu Hz\n", profile,
+		success ? "applied" : "failed",
+		(unsigned long)clock_get_hz(clk_sys));
+}
+
+static pp_job_t pp_clock_job = {
+	.name = "clock",
+	.fn = pp_clock_apply,
+	.priority = 0,
+};
+
+static bool pp_clock_request(uint8_t profile)
+{
+	if (profile >= PP_CLOCK_PROFILE_COUNT)
+		return false;
+
+	/* Applied from the main loop, the switch has to wait for every
+	 * channel's current frame to finish */
+	pp_clock_requested = profile;
+	pp_sched_post(&pp_clock_job, PP_CLOCK_DEADLINE_US);
+
+	return true;
 }
 
 /**
@@ -222,6 +1009,10 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport,
 {
 	bool success = true;
 	vendor_ctrl_chan_cfg_t *chan_cfg;
+	pp_job_info_t *info;
+	pp_caps_t *caps;
+	pp_job_t *job;
+	uint8_t index;
 
 	if (request->bmRequestType_bit.type != TUSB_REQ_TYPE_VENDOR) {
 		success = false;
@@ -232,6 +1023,8 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport,
 		case PP_VENDOR_CTRL_REQ_CFG_CHAN:
 			switch (stage) {
 				case CONTROL_STAGE_SETUP:
+					/* Fields the host doesn't send read as zero */
+					memset(&_ctrl_epbuf, 0, sizeof(_ctrl_epbuf));
 					tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(_ctrl_epbuf));
 					break;
 
@@ -240,24 +1033,98 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport,
 				case CONTROL_STAGE_ACK:
 					chan_cfg = (void *)&_ctrl_epbuf;
 					printf("PP_VENDOR_CTRL_REQ_CFG_CHAN "
-						"index: %d format: 0x%x\n",
-						chan_cfg->index, chan_cfg->format);
-
-					if (chan_cfg->index >= NUM_CHANNELS) {
-						success = false;
-						goto out;
-					}
-
-					success = pp_init_channel(chan_cfg->index, chan_cfg->format);
-					if (!success) goto out;
+						"index: %d format: 0x%x pixels: %d order: 0x%x\n",
+						chan_cfg->index, chan_cfg->format,
+						chan_cfg->pixels, chan_cfg->order);
 
-					pp_pio_init(chan_cfg->index);
-					pp_dma_init(chan_cfg->index);
+					PP_BOOT_MARK(first_cfg_us);
+					success = pp_init_channel(chan_cfg);
 					break;
 
 				default: success = false; goto out;
 			}
 			break;
+
+		case PP_VENDOR_CTRL_REQ_GET_CAPS:
+			if (stage != CONTROL_STAGE_SETUP)
+				break;
+
+			caps = (void *)&_ctrl_epbuf;
+			memset(caps, 0, sizeof(*caps));
+			caps->channels = NUM_CHANNELS;
+			caps->interfaces = CFG_TUD_VENDOR;
+			caps->max_chan_bytes = PIXDATA_BUFSZ;
+			caps->clock_profile = pp_clock_profile;
+			caps->clock_profiles = PP_CLOCK_PROFILE_COUNT;
+			caps->sys_clk_khz = clock_get_hz(clk_sys) / 1000;
+			success = tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(*caps));
+			break;
+
+		case PP_VENDOR_CTRL_REQ_SET_CLOCK:
+			/* Profile in wValue, no data stage */
+			if (stage == CONTROL_STAGE_SETUP)
+				success = pp_clock_request(tu_u16_low(request->wValue)) &&
+					tud_control_status(rhport, request);
+			break;
+
+		case PP_VENDOR_CTRL_REQ_GET_CHAN_STATS:
+			if (stage != CONTROL_STAGE_SETUP)
+				break;
+
+			/* Channel in wValue */
+			index = tu_u16_low(request->wValue);
+			if (index >= NUM_CHANNELS) {
+				success = false;
+				goto out;
+			}
+
+			memcpy(&_ctrl_epbuf, &pp_channels[index].stats, sizeof(pp_chan_stats_t));
+			success = tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(pp_chan_stats_t));
+			break;
+
+		case PP_VENDOR_CTRL_REQ_GET_BOOT_TIMES:
+			if (stage != CONTROL_STAGE_SETUP)
+				break;
+
+			memcpy(&_ctrl_epbuf, &pp_boot, sizeof(pp_boot));
+			success = tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(pp_boot));
+			break;
+
+		case PP_VENDOR_CTRL_REQ_GET_JOB_STATS:
+			if (stage != CONTROL_STAGE_SETUP)
+				break;
+
+			/* Job in wValue, in the order jobs were added. Stalls
+			 * past the last one. */
+			job = pp_sched_job(tu_u16_low(request->wValue));
+			if (job == NULL) {
+				success = false;
+				goto out;
+			}
+
+			info = (void *)&_ctrl_epbuf;
+			memset(info, 0, sizeof(*info));
+			strncpy(info->name, job->name, sizeof(info->name) - 1);
+			info->runs = job->stats.runs;
+			info->late = job->stats.late;
+			info->max_us = job->stats.max_us;
+			info->total_us = job->stats.total_us;
+			success = tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(*info));
+			break;
+
+		case PP_VENDOR_CTRL_REQ_GET_STATS:
+			if (stage != CONTROL_STAGE_SETUP)
+				break;
+
+#if PP_ISO_STREAM
+			pp_stats.iso_dropped = pp_iso_dropped();
+#endif
+			memcpy(&_ctrl_epbuf, &pp_stats, sizeof(pp_stats));
+			/* Report the worst wait since the last read */
+			pp_stats.max_wait_us = 0;
+			success = tud_control_xfer(rhport, request, &_ctrl_epbuf, sizeof(pp_stats));
+			break;
+
 		default:
 			success = false; goto out;
 	}
@@ -266,40 +1133,332 @@ out:
 	return success;
 }
 
-void tud_vendor_rx_cb(uint8_t itf, uint8_t const* buffer, uint16_t bufsize)
+/* Convert len bytes into a channel's buffer at offset, then output the
+ * first out_len bytes of the buffer, or nothing if out_len is 0 */
+static bool pp_channel_update(uint8_t channel, uint16_t offset,
+	uint8_t const *data, uint16_t len, uint16_t out_len, bool block)
 {
 	pp_channel_t *chan;
+	uint32_t start, wait;
+
+	if (len == 0 || len > PIXDATA_BUFSZ) {
+		printf("Invalid buffer size %d (max %d)\n", len, PIXDATA_BUFSZ);
+		pp_stats.rx_errors++;
+		return false;
+	}
+
+	chan = &pp_channels[channel];
+	if (!chan->configured) {
+		printf("Buffer write to unconfigured buffer %d\n", channel);
+		pp_stats.rx_errors++;
+		return false;
+	}
+
+	if (offset + len > pp_chan_frame_len(chan) ||
+	    out_len > pp_chan_frame_len(chan)) {
+		printf("Buffer write of %d at %d to channel %d sized %d\n",
+			len, offset, channel, pp_chan_frame_len(chan));
+		pp_stats.rx_errors++;
+		return false;
+	}
+
+	/* Channels are always resized to hold their configured frame */
+	assert(pp_chan_frame_len(chan) <= chan->num_blocks * PP_BLOCK_SIZE);
+
+#if !PP_OUTPUT_HSTX
+	if (out_len && out_len <= PP_FIFO_DIRECT_MAX)
+		return pp_fifo_write(chan, offset, data, len, out_len, block);
+#endif
+
+	if (block) {
+		start = time_us_32();
+		sem_acquire_blocking(pp_output_sem(chan));
+		wait = time_us_32() - start;
+		if (wait > pp_stats.max_wait_us)
+			pp_stats.max_wait_us = wait;
+	} else if (!sem_try_acquire(pp_output_sem(chan))) {
+		return false;
+	}
+
+	/* Convert into channel buffer and start it going out */
+	pp_chan_convert(chan, offset, data, len);
+
+	if (!out_len) {
+		sem_release(pp_output_sem(chan));
+		return true;
+	}
+
+	/* The previous frame may have been a direct one */
+	pp_output_drain(chan);
+	pp_output_start(chan, out_len);
+	PP_BOOT_MARK(first_frame_us);
+
+	return true;
+}
+
+bool pp_channel_write(uint8_t channel, uint8_t const *data, uint16_t len,
+	bool block)
+{
+	return pp_channel_update(channel, 0, data, len, len, block);
+}
+
+bool pp_channel_patch(uint8_t channel, uint16_t offset, uint8_t const *data,
+	uint16_t len, bool defer, bool block)
+{
+	pp_channel_t *chan = &pp_channels[channel];
+
+	/* Kernels reorder whole pixels, so a patch has to start on one */
+	if (chan->configured && offset % chan->Bpp) {
+		printf("Patch offset %d not on a pixel in channel %d\n",
+			offset, channel);
+		pp_stats.rx_errors++;
+		return false;
+	}
+
+	return pp_channel_update(channel, offset, data, len,
+		defer ? 0 : pp_chan_frame_len(chan), block);
+}
+
+/**
+ * Bulk writes
+ *
+ * Never wait for a busy channel from tud_vendor_rx_cb(): that would hold
+ * up tud_task(), and with it writes that have already arrived for every
+ * other group. A write for a busy channel is held instead, with its
+ * interface's OUT endpoint claimed so the vendor driver doesn't re-arm
+ * it. The packet stays in the endpoint buffer and the host only waits
+ * on that one group until the channel frees.
+ */
+
+typedef struct {
+	uint8_t const *buf;	/* NULL when nothing is held */
+	uint16_t len;
+	uint32_t since;
+} pp_rx_held_t;
+
+static pp_rx_held_t pp_rx_held[CFG_TUD_VENDOR];
+
+/* Deadline for retrying held writes */
+#define PP_RX_RETRY_US 100
 
-	(void) itf;
+/* Hand a bulk write to its channel. Returns false, having done nothing,
+ * only if the channel is busy; every other write is either taken or
+ * rejected and counted. */
+static bool pp_rx_write(uint8_t itf, uint8_t const *buffer, uint16_t bufsize)
+{
+	uint8_t channel = buffer[0] & PP_CHAN_INDEX_MASK;
+	pp_channel_t *chan;
+	uint16_t offset;
 
-	uint8_t channel = buffer[0];
 	if (channel > NUM_CHANNELS - 1) {
 		printf("Invalid channel index %d\n", channel);
+		pp_stats.rx_errors++;
+		return true;
+	}
+
+	if (channel / PP_CHANNELS_PER_ITF != itf) {
+		printf("Channel %d not in group for interface %d\n", channel, itf);
+		pp_stats.rx_errors++;
+		return true;
+	}
+
+	if ((buffer[0] & (PP_CHAN_PATCH | PP_CHAN_DEFER)) == PP_CHAN_DEFER) {
+		printf("Deferred write to channel %d without a patch offset\n", channel);
+		pp_stats.rx_errors++;
+		return true;
+	}
+
+	/* Writes to an unconfigured channel are rejected by the update */
+	chan = &pp_channels[channel];
+	if (chan->configured && pp_output_busy(chan))
+		return false;
+
+	if (!(buffer[0] & PP_CHAN_PATCH)) {
+		pp_channel_write(channel, &buffer[1], bufsize - 1, false);
+		return true;
+	}
+
+	if (bufsize < 3) {
+		printf("Short patch for channel %d\n", channel);
+		pp_stats.rx_errors++;
+		return true;
+	}
+
+	offset = buffer[1] | buffer[2] << 8;
+	pp_channel_patch(channel, offset, &buffer[3], bufsize - 3,
+		buffer[0] & PP_CHAN_DEFER, false);
+
+	return true;
+}
+
+static pp_job_t pp_rx_job;
+
+static void pp_rx_retry(void *arg)
+{
+	pp_rx_held_t *held;
+	bool waiting = false;
+	uint32_t wait;
+	uint8_t itf;
+
+	(void) arg;
+
+	/* A bus reset has already dropped the endpoints and their buffers */
+	if (!tud_mounted()) {
+		memset(pp_rx_held, 0, sizeof(pp_rx_held));
 		return;
 	}
 
-	if (bufsize > PIXDATA_BUFSZ) {
-		printf("Buffer size too big %d (max %d)\n", bufsize, PIXDATA_BUFSZ);
+	for (itf = 0; itf < CFG_TUD_VENDOR; itf++) {
+		held = &pp_rx_held[itf];
+		if (held->buf == NULL)
+			continue;
+
+		if (!pp_rx_write(itf, held->buf, held->len)) {
+			waiting = true;
+			continue;
+		}
+
+		wait = time_us_32() - held->since;
+		if (wait > pp_stats.max_wait_us)
+			pp_stats.max_wait_us = wait;
+
+		/* Re-arm into the same buffer, under the claim taken when the
+		 * write was held. The transfer completing drops the claim and
+		 * goes through the vendor driver as usual. */
+		usbd_edpt_xfer(BOARD_TUD_RHPORT, PP_EP_VENDOR_OUT(itf),
+			(uint8_t *)held->buf, CFG_TUD_VENDOR_EPSIZE);
+		held->buf = NULL;
+	}
+
+	if (waiting)
+		pp_sched_post(&pp_rx_job, PP_RX_RETRY_US);
+}
+
+static pp_job_t pp_rx_job = {
+	.name = "rx",
+	.fn = pp_rx_retry,
+	.priority = 0,
+};
+
+void tud_vendor_rx_cb(uint8_t itf, uint8_t const* buffer, uint16_t bufsize)
+{
+	pp_rx_held_t *held = &pp_rx_held[itf];
+
+	if (pp_rx_write(itf, buffer, bufsize))
+		return;
+
+	/* The endpoint is free to claim, the completion that got us here
+	 * has just released it */
+	usbd_edpt_claim(BOARD_TUD_RHPORT, PP_EP_VENDOR_OUT(itf));
+
+	held->buf = buffer;
+	held->len = bufsize;
+	held->since = time_us_32();
+	pp_sched_post(&pp_rx_job, PP_RX_RETRY_US);
+}
+
+/**
+ * Boot
+ *
+ * Only what enumeration needs runs before the USB stack is up. Channels
+ * from PP_BOOT_CHANNELS are brought up by a job while the host enumerates,
+ * so they can take frames as soon as the device is mounted. Nothing logs
+ * from them or from the enumeration callbacks: what they'd have logged is
+ * deferred to a job that runs once the device is mounted.
+ */
+
+/* Channels configured at boot, before any host request, as a list of
+ * {index, format, pixels, order}, entries each followed by a comma. A
+ * matching CFG_CHAN from the host later on is a no-op. */
+#ifndef PP_BOOT_CHANNELS
+#define PP_BOOT_CHANNELS
+#endif
+
+static const vendor_ctrl_chan_cfg_t pp_boot_channels[] = {
+	PP_BOOT_CHANNELS
+	{ .format = PP_FORMAT_UNSET }
+};
+
+static pp_job_t pp_boot_chans_job;
+
+static pp_job_t pp_boot_log_job;
+
+/* Whether each PP_BOOT_CHANNELS entry was configured, for the boot log */
+static bool pp_boot_chans_ok[sizeof(pp_boot_channels) / sizeof(pp_boot_channels[0])];
+
+static void pp_boot_chans_apply(void *arg)
+{
+	static uint8_t next;
+
+	(void) arg;
+
+	/* One channel per run, so tud_task() keeps up with enumeration */
+	if (pp_boot_channels[next].format != PP_FORMAT_UNSET) {
+		pp_log_quiet = true;
+		pp_boot_chans_ok[next] = pp_init_channel(&pp_boot_channels[next]);
+		pp_log_quiet = false;
+		next++;
+		pp_sched_post(&pp_boot_chans_job, 0);
 		return;
 	}
 
-	chan = &pp_channels[channel];
-	if (!chan->configured) {
-		printf("Buffer write to unconfigured buffer %d\n", channel);
+	PP_BOOT_MARK(boot_chans_us);
+	pp_sched_post(&pp_boot_log_job, 0);
+}
+
+static pp_job_t pp_boot_chans_job = {
+	.name = "boot_chans",
+	.fn = pp_boot_chans_apply,
+	.priority = 0,
+};
+
+/* Deferred until the boot channels are up and the host has mounted the
+ * device, whichever comes last, so nothing logs during enumeration */
+static void pp_boot_log(void *arg)
+{
+	static bool logged;
+	vendor_ctrl_chan_cfg_t const *cfg;
+	uint8_t i;
+
+	(void) arg;
+
+	if (logged || !pp_boot.boot_chans_us || !tud_mounted())
 		return;
+	logged = true;
+
+	for (i = 0; pp_boot_channels[i].format != PP_FORMAT_UNSET; i++) {
+		cfg = &pp_boot_channels[i];
+		printf("Boot channel %d format 0x%x pixels %d order 0x%x %s\n",
+			cfg->index, cfg->format, cfg->pixels, cfg->order,
+			pp_boot_chans_ok[i] ? "configured" : "failed");
 	}
 
-	/* Copy to channel buffer and trigger DMA to PIO FIFO */
-	sem_acquire_blocking(&chan->xfer_finished_sem);
-	memcpy(&chan->buf[0], &buffer[1], bufsize - 1);
-	dma_channel_transfer_from_buffer_now(chan->cfg.index, &chan->buf[0],
-		dma_encode_transfer_count(bufsize - 1));
+	printf("Boot us: main %lu usb %lu channels %lu mounted %lu\n",
+		(unsigned long)pp_boot.main_us,
+		(unsigned long)pp_boot.usb_init_us,
+		(unsigned long)pp_boot.boot_chans_us,
+		(unsigned long)pp_boot.mounted_us);
+}
 
-	return;
+static pp_job_t pp_boot_log_job = {
+	.name = "boot_log",
+	.fn = pp_boot_log,
+	.priority = 1,
+};
+
+void tud_mount_cb(void)
+{
+	/* Endpoints were opened afresh, anything held went with the old ones */
+	memset(pp_rx_held, 0, sizeof(pp_rx_held));
+
+	PP_BOOT_MARK(mounted_us);
+	pp_sched_post(&pp_boot_log_job, 0);
 }
 
 int main(void)
 {
+    PP_BOOT_MARK(main_us);
+
     stdio_uart_init();
 
     board_init();
@@ -309,10 +1468,19 @@ int main(void)
         board_init_after_tusb();
     }
 
-    /* Main loop handling USB requests */
-    while (1) {
-        tud_task();
-    }
+    PP_BOOT_MARK(usb_init_us);
+
+    pp_pool_init();
+    pp_output_engine_init();
+    pp_sched_add(&pp_clock_job);
+    pp_sched_add(&pp_rx_job);
+    pp_sched_add(&pp_boot_chans_job);
+    pp_sched_add(&pp_boot_log_job);
+
+    pp_sched_post(&pp_boot_chans_job, 0);
+
+    /* Main loop handling USB requests and background jobs */
+    pp_sched_run();
 
     return 0;
 }
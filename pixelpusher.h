@@ -0,0 +1,126 @@
+#ifndef _PIXELPUSHER_H_
+#define _PIXELPUSHER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NUM_CHANNELS 8
+
+#define PIXDATA_BUFSZ 4096
+
+/* Bulk OUT endpoint of vendor interface n, one interface per group of
+ * NUM_CHANNELS / CFG_TUD_VENDOR channels */
+#define PP_EP_VENDOR_OUT(n)	(0x01 + (n))
+
+/* Channel buffers are lists of fixed-size blocks from a shared pool. The
+ * size is a multiple of both 3 and 4 so that no RGB or RGBW pixel is
+ * ever split across two blocks. */
+#define PP_BLOCK_SIZE 384
+#define PP_CHAN_MAX_BLOCKS ((PIXDATA_BUFSZ + PP_BLOCK_SIZE - 1) / PP_BLOCK_SIZE)
+
+#define PP_FORMAT_UNSET	0x0
+#define PP_FORMAT_RGB	0x1
+#define PP_FORMAT_RGBW	0x2
+
+/* Order the strip expects the colour components in, the host always
+ * sends R, G, B. W, when present, is always sent last. */
+#define PP_ORDER_RGB	0x0
+#define PP_ORDER_RBG	0x1
+#define PP_ORDER_GRB	0x2
+#define PP_ORDER_GBR	0x3
+#define PP_ORDER_BRG	0x4
+#define PP_ORDER_BGR	0x5
+#define PP_ORDER_COUNT	0x6
+
+/* System clock profiles, selected with PP_VENDOR_CTRL_REQ_SET_CLOCK.
+ * Faster profiles leave more CPU for device side processing. */
+#define PP_CLOCK_PROFILE_LOW		0x0	/* 100MHz */
+#define PP_CLOCK_PROFILE_DEFAULT	0x1	/* 150MHz */
+#define PP_CLOCK_PROFILE_FAST		0x2	/* 200MHz */
+#define PP_CLOCK_PROFILE_COUNT		0x3
+
+/* Bulk OUT writes start with a channel byte. Without PP_CHAN_PATCH the
+ * rest is a whole frame. With it, a little endian u16 byte offset
+ * follows, then data that only replaces that part of the last frame,
+ * so sparse updates don't have to resend the whole strip. */
+#define PP_CHAN_INDEX_MASK	0x3f
+#define PP_CHAN_DEFER		0x40	/* Patch only, don't output yet */
+#define PP_CHAN_PATCH		0x80
+
+/* Sent with PP_VENDOR_CTRL_REQ_CFG_CHAN, "<BBHB" on the host */
+typedef struct __attribute__((packed)) {
+	uint8_t index;
+	uint8_t format;			/* PP_FORMAT_, unset to remove */
+	uint16_t pixels;
+	uint8_t order;			/* PP_ORDER_ */
+} vendor_ctrl_chan_cfg_t;
+
+/* Returned by PP_VENDOR_CTRL_REQ_GET_CAPS */
+typedef struct __attribute__((packed)) {
+	uint8_t channels;
+	uint8_t interfaces;		/* Vendor interfaces, channels split
+					 * evenly between them */
+	uint16_t max_chan_bytes;	/* Largest frame per channel */
+	uint8_t clock_profile;		/* Current PP_CLOCK_PROFILE_ */
+	uint8_t clock_profiles;		/* Number of profiles supported */
+	uint16_t reserved;
+	uint32_t sys_clk_khz;
+} pp_caps_t;
+
+/* Device counters returned by PP_VENDOR_CTRL_REQ_GET_STATS, so long
+ * running tests can check for leaks and races from the host. */
+typedef struct __attribute__((packed)) {
+	uint32_t frames;		/* Frames sent and latched */
+	uint32_t rx_errors;		/* Writes rejected for channel or size */
+	uint32_t alarm_failures;	/* Latch alarms that couldn't be added */
+	uint32_t sem_errors;		/* Latch releases with no transfer */
+	uint32_t max_wait_us;		/* Longest wait for a busy channel,
+					 * reset on every read */
+	uint32_t iso_dropped;		/* Iso frames lost or late */
+} pp_dev_stats_t;
+
+/* Per channel counters returned by PP_VENDOR_CTRL_REQ_GET_CHAN_STATS */
+typedef struct __attribute__((packed)) {
+	uint32_t frames;		/* Frames sent and latched */
+	uint32_t underruns;		/* PIO FIFO ran dry mid-frame */
+	uint32_t retransmits;		/* Frames sent again after underrun */
+} pp_chan_stats_t;
+
+/* Scheduler job counters returned by PP_VENDOR_CTRL_REQ_GET_JOB_STATS,
+ * so a host can see which job held up USB and when. Times are in
+ * microseconds. */
+typedef struct __attribute__((packed)) {
+	char name[12];			/* NUL terminated */
+	uint32_t runs;
+	uint32_t late;			/* Runs that started after their
+					 * deadline */
+	uint32_t max_us;		/* Longest single run */
+	uint64_t total_us;
+} pp_job_info_t;
+
+/* Boot phase timestamps returned by PP_VENDOR_CTRL_REQ_GET_BOOT_TIMES, in
+ * microseconds since power on. Phases not reached yet read as zero. */
+typedef struct __attribute__((packed)) {
+	uint32_t main_us;		/* main() entered */
+	uint32_t usb_init_us;		/* USB stack up, host can enumerate */
+	uint32_t boot_chans_us;		/* PP_BOOT_CHANNELS configured */
+	uint32_t mounted_us;		/* Host selected the configuration */
+	uint32_t first_cfg_us;		/* First CFG_CHAN from the host */
+	uint32_t first_frame_us;	/* First frame accepted on a channel */
+} pp_boot_times_t;
+
+/* Copy a frame of len bytes into a channel's buffer and start output.
+ * If block is false and the channel is still sending or latching its
+ * previous frame, the new frame is dropped and false is returned. */
+bool pp_channel_write(uint8_t channel, uint8_t const *data, uint16_t len,
+	bool block);
+
+/* Overwrite len bytes of a channel's buffer from byte offset, which must
+ * be on a pixel boundary, then output the whole configured frame. The
+ * buffer is blanked whenever the channel is configured, so pixels not
+ * written since then go out dark. With defer the buffer is only updated,
+ * and goes out with the next write or patch to the channel. */
+bool pp_channel_patch(uint8_t channel, uint16_t offset, uint8_t const *data,
+	uint16_t len, bool defer, bool block);
+
+#endif /* _PIXELPUSHER_H_ */
@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "pixelpusher.h"
+#include "pp_convert.h"
+
+/**
+ * Conversion kernels
+ *
+ * One kernel is generated per supported combination of channel options
+ * so the per-pixel loop has no option checks in it. The host order is
+ * always R, G, B(, W), so the identity order is a plain copy.
+ */
+
+static void pp_convert_copy(uint8_t *dst, uint8_t const *src, uint16_t len)
+{
+	memcpy(dst, src, len);
+}
+
+/* Output component n comes from input component cn */
+#define PP_CONVERT_KERNEL(name, Bpp, c0, c1, c2) \
+static void name(uint8_t *dst, uint8_t const *src, uint16_t len) \
+{ \
+	uint8_t const *end = src + len - len % (Bpp); \
+ \
+	for (; src < end; src += (Bpp), dst += (Bpp)) { \
+		dst[0] = src[c0]; \
+		dst[1] = src[c1]; \
+		dst[2] = src[c2]; \
+		if ((Bpp) == 4) \
+			dst[3] = src[3]; \
+	} \
+ \
+	memcpy(dst, src, len % (Bpp)); \
+}
+
+/* Every colour order other than the identity */
+#define PP_SWIZZLES(X) \
+	X(RBG, 0, 2, 1) \
+	X(GRB, 1, 0, 2) \
+	X(GBR, 1, 2, 0) \
+	X(BRG, 2, 0, 1) \
+	X(BGR, 2, 1, 0)
+
+#define PP_KERNEL_RGB(order, c0, c1, c2) \
+	PP_CONVERT_KERNEL(pp_convert_rgb_##order, 3, c0, c1, c2)
+#define PP_KERNEL_RGBW(order, c0, c1, c2) \
+	PP_CONVERT_KERNEL(pp_convert_rgbw_##order, 4, c0, c1, c2)
+
+PP_SWIZZLES(PP_KERNEL_RGB)
+PP_SWIZZLES(PP_KERNEL_RGBW)
+
+#define PP_ENTRY_RGB(order, c0, c1, c2) \
+	[PP_ORDER_##order] = pp_convert_rgb_##order,
+#define PP_ENTRY_RGBW(order, c0, c1, c2) \
+	[PP_ORDER_##order] = pp_convert_rgbw_##order,
+
+static pp_convert_fn_t const pp_convert_table[][PP_ORDER_COUNT] = {
+	[PP_FORMAT_RGB] = {
+		[PP_ORDER_RGB] = pp_convert_copy,
+		PP_SWIZZLES(PP_ENTRY_RGB)
+	},
+	[PP_FORMAT_RGBW] = {
+		[PP_ORDER_RGB] = pp_convert_copy,
+		PP_SWIZZLES(PP_ENTRY_RGBW)
+	},
+};
+
+#define PP_NUM_FORMATS (sizeof(pp_convert_table) / sizeof(pp_convert_table[0]))
+
+pp_convert_fn_t pp_convert_lookup(uint8_t format, uint8_t order)
+{
+	if (format >= PP_NUM_FORMATS || order >= PP_ORDER_COUNT)
+		return NULL;
+
+	return pp_convert_table[format][order];
+}
@@ -0,0 +1,14 @@
+#ifndef _PP_CONVERT_H_
+#define _PP_CONVERT_H_
+
+#include <stdint.h>
+
+/* Copy len bytes of host pixel data from src into dst in wire format.
+ * A trailing partial pixel is copied as is. */
+typedef void (*pp_convert_fn_t)(uint8_t *dst, uint8_t const *src, uint16_t len);
+
+/* Kernel specialised for a format and colour order, or NULL if the
+ * combination isn't supported */
+pp_convert_fn_t pp_convert_lookup(uint8_t format, uint8_t order);
+
+#endif /* _PP_CONVERT_H_ */
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/time.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/structs/hstx_ctrl.h"
+#include "hardware/structs/hstx_fifo.h"
+
+#include "pixelpusher.h"
+#include "pp_hstx.h"
+
+/* clk_hstx runs from pll_usb, so it is unaffected by clk_sys profiles */
+#define PP_HSTX_CLK_HZ (USB_CLK_HZ / 4)
+
+/* Each FIFO word is held on the pins for this many clk_hstx cycles. Three
+ * of these slots make a WS2812 bit: 417ns each at 12MHz, 1.25us per bit. */
+#define PP_HSTX_SLOT_CYCLES 5
+#define PP_HSTX_WORDS_PER_BYTE (8 * 3)
+
+/* Byte positions encoded per DMA buffer */
+#define PP_HSTX_CHUNK 32
+#define PP_HSTX_CHUNK_WORDS (PP_HSTX_CHUNK * PP_HSTX_WORDS_PER_BYTE)
+
+/* So that no chunk spans two of a lane's blocks */
+#if PP_BLOCK_SIZE % PP_HSTX_CHUNK
+#error "PP_BLOCK_SIZE must be a multiple of PP_HSTX_CHUNK"
+#endif
+
+/* Time for the HSTX FIFO to empty after the last DMA write */
+#define PP_HSTX_DRAIN_US 10
+
+static struct {
+	int dma[2];
+	uint8_t *const *lanes[PP_HSTX_LANES];
+	uint16_t lens[PP_HSTX_LANES];
+	uint16_t chunks;
+	volatile uint16_t encoded;	/* Chunks handed to the DMA */
+	volatile uint16_t sent;		/* Chunks the DMA has finished */
+	uint32_t reset_us;
+	pp_hstx_done_fn_t done;
+} _hstx;
+
+static uint32_t _hstx_buf[2][PP_HSTX_CHUNK_WORDS];
+
+/* Transpose an 8x8 bit matrix: planes[b] holds bit 7 - b of every input
+ * byte, with input n at bit n. Hacker's Delight, section 7-3. */
+static inline void pp_hstx_transpose(uint8_t const in[8], uint8_t planes[8])
+{
+	uint32_t x, y, t;
+
+	x = (uint32_t)in[7] << 24 | (uint32_t)in[6] << 16 | (uint32_t)in[5] << 8 | in[4];
+	y = (uint32_t)in[3] << 24 | (uint32_t)in[2] << 16 | (uint32_t)in[1] << 8 | in[0];
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA;  x = x ^ t ^ (t << 7);
+	t = (y ^ (y >> 7)) & 0x00AA00AA;  y = y ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC; x = x ^ t ^ (t << 14);
+	t = (y ^ (y >> 14)) & 0x0000CCCC; y = y ^ t ^ (t << 14);
+	t = (x & 0xF0F0F0F0) | ((y >> 4) & 0x0F0F0F0F);
+	y = ((x << 4) & 0xF0F0F0F0) | (y & 0x0F0F0F0F);
+	x = t;
+
+	planes[0] = x >> 24; planes[1] = x >> 16; planes[2] = x >> 8; planes[3] = x;
+	planes[4] = y >> 24; planes[5] = y >> 16; planes[6] = y >> 8; planes[7] = y;
+}
+
+/* Encode one chunk of byte positions into FIFO words, returns the word count */
+static uint32_t pp_hstx_encode(uint32_t *out, uint16_t chunk)
+{
+	uint32_t *start = out;
+	uint8_t const *src[PP_HSTX_LANES];
+	uint8_t in[PP_HSTX_LANES];
+	uint8_t planes[8];
+	uint8_t active;
+	uint16_t first = chunk * PP_HSTX_CHUNK;
+	uint16_t pos;
+	uint8_t lane;
+	uint8_t bit;
+
+	for (lane = 0; lane < PP_HSTX_LANES; lane++) {
+		if (first < _hstx.lens[lane])
+			src[lane] = _hstx.lanes[lane][first / PP_BLOCK_SIZE] +
+				first % PP_BLOCK_SIZE;
+	}
+
+	for (pos = first; pos < first + PP_HSTX_CHUNK; pos++) {
+		active = 0;
+		for (lane = 0; lane < PP_HSTX_LANES; lane++) {
+			if (pos < _hstx.lens[lane]) {
+				in[lane] = src[lane][pos - first];
+				active |= 1u << lane;
+			} else {
+				in[lane] = 0;
+			}
+		}
+
+		if (!active)
+			break;
+
+		pp_hstx_transpose(in, planes);
+		for (bit = 0; bit < 8; bit++) {
+			*out++ = active;
+			*out++ = planes[bit];
+			*out++ = 0;
+		}
+	}
+
+	return out - start;
+}
+
+static int64_t pp_hstx_latched(alarm_id_t id, void *user_data)
+{
+	(void) id;
+	(void) user_data;
+
+	_hstx.done();
+
+	return 0;
+}
+
+static void pp_hstx_refill(uint8_t i)
+{
+	uint32_t words;
+
+	if (++_hstx.sent == _hstx.chunks) {
+		/* Last chunk is in the FIFO, let it drain and the strips latch */
+		if (add_alarm_in_us(PP_HSTX_DRAIN_US + _hstx.reset_us,
+				pp_hstx_latched, NULL, true) < 0)
+			_hstx.done();
+		return;
+	}
+
+	if (_hstx.encoded < _hstx.chunks) {
+		/* The other buffer is going out now, refill this one behind it */
+		words = pp_hstx_encode(_hstx_buf[i], _hstx.encoded++);
+		dma_channel_set_read_addr(_hstx.dma[i], _hstx_buf[i], false);
+		dma_channel_set_trans_count(_hstx.dma[i], words, false);
+	} else {
+		/* Nothing left to queue, ignore the other buffer's chain trigger */
+		hw_clear_bits(&dma_hw->ch[_hstx.dma[i]].al1_ctrl,
+			DMA_CH0_CTRL_TRIG_EN_BITS);
+	}
+}
+
+static void pp_hstx_dma_handler(void)
+{
+	uint8_t i;
+
+	/* Buffers complete in order, so service them in order */
+	for (i = 0; i < 2; i++) {
+		if (!(dma_hw->ints1 & (1u << _hstx.dma[i])))
+			continue;
+
+		dma_hw->ints1 = 1u << _hstx.dma[i];
+		pp_hstx_refill(i);
+	}
+}
+
+void pp_hstx_start(uint8_t *const *const lanes[PP_HSTX_LANES],
+		uint16_t const lens[PP_HSTX_LANES], pp_hstx_done_fn_t done)
+{
+	dma_channel_config c;
+	uint32_t words[2] = {0, 0};
+	uint16_t bytes = 0;
+	uint8_t lane;
+	uint8_t i;
+
+	for (lane = 0; lane < PP_HSTX_LANES; lane++) {
+		_hstx.lanes[lane] = lanes[lane];
+		_hstx.lens[lane] = lanes[lane] ? lens[lane] : 0;
+		if (_hstx.lens[lane] > bytes)
+			bytes = _hstx.lens[lane];
+	}
+
+	if (!bytes) {
+		done();
+		return;
+	}
+
+	_hstx.done = done;
+	_hstx.chunks = (bytes + PP_HSTX_CHUNK - 1) / PP_HSTX_CHUNK;
+	_hstx.sent = 0;
+	_hstx.encoded = 0;
+
+	for (i = 0; i < 2 && _hstx.encoded < _hstx.chunks; i++)
+		words[i] = pp_hstx_encode(_hstx_buf[i], _hstx.encoded++);
+
+	for (i = 0; i < 2; i++) {
+		c = dma_channel_get_default_config(_hstx.dma[i]);
+		channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+		channel_config_set_read_increment(&c, true);
+		channel_config_set_write_increment(&c, false);
+		channel_config_set_dreq(&c, DREQ_HSTX);
+		/* Each buffer starts the other once it's finished */
+		channel_config_set_chain_to(&c,
+			_hstx.chunks > 1 ? _hstx.dma[!i] : _hstx.dma[i]);
+
+		dma_channel_configure(_hstx.dma[i], &c, &hstx_fifo_hw->fifo,
+			_hstx_buf[i], words[i], false);
+	}
+
+	dma_channel_start(_hstx.dma[0]);
+}
+
+void pp_hstx_lane_init(uint8_t lane)
+{
+	gpio_set_function(PP_HSTX_FIRST_PIN + lane, GPIO_FUNC_HSTX);
+}
+
+void pp_hstx_lane_deinit(uint8_t lane)
+{
+	uint pin = PP_HSTX_FIRST_PIN + lane;
+
+	/* Hold the data line low rather than leaving it floating */
+	gpio_init(pin);
+	gpio_set_dir(pin, GPIO_OUT);
+	gpio_put(pin, 0);
+}
+
+bool pp_hstx_init(uint32_t reset_us)
+{
+	uint8_t lane;
+	uint8_t i;
+
+	memset(&_hstx, 0, sizeof(_hstx));
+	_hstx.reset_us = reset_us;
+
+	clock_configure(clk_hstx, 0,
+		CLOCKS_CLK_HSTX_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+		USB_CLK_HZ, PP_HSTX_CLK_HZ);
+
+	hstx_ctrl_hw->csr = 0;
+
+	/* Lane n drives shift register bit n on both halves of the clock */
+	for (lane = 0; lane < PP_HSTX_LANES; lane++)
+		hstx_ctrl_hw->bit[lane] =
+			lane << HSTX_CTRL_BIT0_SEL_P_LSB |
+			lane << HSTX_CTRL_BIT0_SEL_N_LSB;
+
+	/* No shifting: every FIFO word is presented as-is for
+	 * PP_HSTX_SLOT_CYCLES cycles before the next one is popped */
+	hstx_ctrl_hw->csr =
+		PP_HSTX_SLOT_CYCLES << HSTX_CTRL_CSR_N_SHIFTS_LSB |
+		0u << HSTX_CTRL_CSR_SHIFT_LSB |
+		HSTX_CTRL_CSR_EN_BITS;
+
+	for (i = 0; i < 2; i++) {
+		_hstx.dma[i] = dma_claim_unused_channel(false);
+		if (_hstx.dma[i] < 0) {
+			printf("No DMA channel for HSTX\n");
+			if (i)
+				dma_channel_unclaim(_hstx.dma[0]);
+			return false;
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+		dma_channel_set_irq1_enabled(_hstx.dma[i], true);
+
+	irq_set_exclusive_handler(DMA_IRQ_1, pp_hstx_dma_handler);
+	irq_set_enabled(DMA_IRQ_1, true);
+
+	return true;
+}
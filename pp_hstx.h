@@ -0,0 +1,42 @@
+#ifndef _PP_HSTX_H_
+#define _PP_HSTX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Optional HSTX output engine.
+ *
+ * Drives every channel from the RP2350 HSTX serialiser instead of one PIO
+ * state machine per channel. Channel n is HSTX lane n, on GPIO
+ * PP_HSTX_FIRST_PIN + n. All lanes are clocked out together: each byte
+ * position across the lanes is transposed into eight bit planes and every
+ * WS2812 bit becomes three FIFO words (high, data, low), streamed by a
+ * ping-ponging pair of DMA channels that the encoder keeps one chunk
+ * ahead of.
+ *
+ * Lanes shorter than the longest one are held low once their data ends.
+ */
+
+#define PP_HSTX_LANES 8
+
+#ifndef PP_HSTX_FIRST_PIN
+#define PP_HSTX_FIRST_PIN 12
+#endif
+
+typedef void (*pp_hstx_done_fn_t)(void);
+
+/* Configure clk_hstx, the serialiser and the streaming DMA channels.
+ * reset_us is the latch gap waited out before each frame completes. */
+bool pp_hstx_init(uint32_t reset_us);
+
+void pp_hstx_lane_init(uint8_t lane);
+void pp_hstx_lane_deinit(uint8_t lane);
+
+/* Output lens[n] bytes on every lane at once, lane n's data coming from
+ * the PP_BLOCK_SIZE blocks listed in lanes[n]. done is called from
+ * interrupt context once the frame has latched. */
+void pp_hstx_start(uint8_t *const *const lanes[PP_HSTX_LANES],
+		uint16_t const lens[PP_HSTX_LANES], pp_hstx_done_fn_t done);
+
+#endif /* _PP_HSTX_H_ */
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <string.h>
+#include <tusb.h>
+#include <device/usbd_pvt.h>
+
+#include "pixelpusher.h"
+#include "pp_iso.h"
+
+typedef struct {
+	bool active;
+	uint8_t seq;
+	uint16_t len;
+	uint16_t received;
+	uint8_t buf[PIXDATA_BUFSZ];
+} pp_iso_frame_t;
+
+static struct {
+	uint8_t itf_num;
+	uint8_t alt;
+	uint8_t ep_out;
+	tusb_desc_endpoint_t const *ep_desc;
+	/* Frames lost to missing packets or a busy channel */
+	uint32_t dropped;
+} _iso;
+
+static pp_iso_frame_t _iso_frames[NUM_CHANNELS];
+
+CFG_TUD_MEM_SECTION static struct {
+	TUD_EPBUF_DEF(buf, PP_ISO_EP_SIZE);
+} _iso_epbuf;
+
+static void pp_iso_rx_packet(uint8_t const *buf, uint16_t len)
+{
+	pp_iso_pkt_hdr_t hdr;
+	pp_iso_frame_t *frame;
+	uint16_t payload;
+
+	/* Host sends empty packets in frames it has nothing for */
+	if (len < sizeof(hdr))
+		return;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	payload = len - sizeof(hdr);
+
+	if (hdr.channel >= NUM_CHANNELS || hdr.len == 0 ||
+	    hdr.len > PIXDATA_BUFSZ || hdr.offset + payload > hdr.len) {
+		printf("Invalid iso packet channel %d offset %d len %d\n",
+			hdr.channel, hdr.offset, hdr.len);
+		return;
+	}
+
+	frame = &_iso_frames[hdr.channel];
+
+	if (hdr.offset == 0) {
+		/* Start of a new frame, abandoning any partial one */
+		if (frame->active)
+			_iso.dropped++;
+
+		frame->active = true;
+		frame->seq = hdr.seq;
+		frame->len = hdr.len;
+		frame->received = 0;
+	} else if (!frame->active || frame->seq != hdr.seq ||
+		   frame->len != hdr.len || frame->received != hdr.offset) {
+		/* A packet went missing, wait for the next frame */
+		if (frame->active)
+			_iso.dropped++;
+
+		frame->active = false;
+		return;
+	}
+
+	memcpy(&frame->buf[hdr.offset], &buf[sizeof(hdr)], payload);
+	frame->received += payload;
+
+	if (frame->received < frame->len)
+		return;
+
+	/* Frame complete. Never wait for the channel here: a late frame is
+	 * dropped so that latency stays bounded. */
+	frame->active = false;
+	if (!pp_channel_write(hdr.channel, frame->buf, frame->len, false))
+		_iso.dropped++;
+}
+
+static void pp_iso_set_alt(uint8_t rhport, uint8_t alt)
+{
+	if (alt == _iso.alt)
+		return;
+
+	_iso.alt = alt;
+
+	if (alt) {
+		memset(_iso_frames, 0, sizeof(_iso_frames));
+		usbd_edpt_iso_activate(rhport, _iso.ep_desc);
+		usbd_edpt_xfer(rhport, _iso.ep_out, _iso_epbuf.buf, PP_ISO_EP_SIZE);
+	} else {
+		usbd_edpt_close(rhport, _iso.ep_out);
+	}
+
+	printf("Iso stream %s\n", alt ? "enabled" : "disabled");
+}
+
+uint32_t pp_iso_dropped(void)
+{
+	return _iso.dropped;
+}
+
+/**
+ * TinyUSB class driver
+ */
+
+static void pp_iso_init(void)
+{
+	memset(&_iso, 0, sizeof(_iso));
+}
+
+static bool pp_iso_deinit(void)
+{
+	return true;
+}
+
+static void pp_iso_reset(uint8_t rhport)
+{
+	(void) rhport;
+
+	pp_iso_init();
+}
+
+static uint16_t pp_iso_open(uint8_t rhport,
+		tusb_desc_interface_t const *itf_desc, uint16_t max_len)
+{
+	uint8_t const *p_desc = (uint8_t const *)itf_desc;
+	uint8_t const *p_end = p_desc + max_len;
+
+	/* Leave the plain vendor interfaces to the TinyUSB vendor driver */
+	TU_VERIFY(itf_desc->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC &&
+		  itf_desc->bInterfaceSubClass == PP_ISO_SUBCLASS, 0);
+
+	_iso.itf_num = itf_desc->bInterfaceNumber;
+	_iso.ep_desc = NULL;
+
+	/* Consume every alternate setting of this interface */
+	p_desc = tu_desc_next(p_desc);
+	while (p_desc < p_end) {
+		if (tu_desc_type(p_desc) == TUSB_DESC_INTERFACE &&
+		    ((tusb_desc_interface_t const *)p_desc)->bInterfaceNumber
+				!= _iso.itf_num)
+			break;
+
+		if (tu_desc_type(p_desc) == TUSB_DESC_ENDPOINT)
+			_iso.ep_desc = (tusb_desc_endpoint_t const *)p_desc;
+
+		p_desc = tu_desc_next(p_desc);
+	}
+
+	TU_VERIFY(_iso.ep_desc != NULL, 0);
+	_iso.ep_out = _iso.ep_desc->bEndpointAddress;
+
+	/* Reserve endpoint buffer space now, the endpoint itself is only
+	 * activated when the host selects alt 1 */
+	TU_ASSERT(usbd_edpt_iso_alloc(rhport, _iso.ep_out,
+		tu_edpt_packet_size(_iso.ep_desc)), 0);
+
+	return (uint16_t)(p_desc - (uint8_t const *)itf_desc);
+}
+
+static bool pp_iso_control_xfer_cb(uint8_t rhport, uint8_t stage,
+		tusb_control_request_t const *request)
+{
+	uint8_t alt;
+
+	if (request->bmRequestType_bit.type != TUSB_REQ_TYPE_STANDARD)
+		return false;
+
+	switch (request->bRequest) {
+		case TUSB_REQ_GET_INTERFACE:
+			if (stage == CONTROL_STAGE_SETUP)
+				return tud_control_xfer(rhport, request, &_iso.alt, 1);
+			return true;
+
+		case TUSB_REQ_SET_INTERFACE:
+			if (stage != CONTROL_STAGE_SETUP)
+				return true;
+
+			alt = tu_u16_low(request->wValue);
+			if (alt > 1)
+				return false;
+
+			pp_iso_set_alt(rhport, alt);
+			return tud_control_status(rhport, request);
+
+		default:
+			return false;
+	}
+}
+
+static bool pp_iso_xfer_cb(uint8_t rhport, uint8_t ep_addr,
+		xfer_result_t result, uint32_t xferred_bytes)
+{
+	if (ep_addr != _iso.ep_out)
+		return false;
+
+	if (result == XFER_RESULT_SUCCESS)
+		pp_iso_rx_packet(_iso_epbuf.buf, (uint16_t)xferred_bytes);
+
+	/* Queue the buffer for the next frame's packet */
+	if (_iso.alt)
+		usbd_edpt_xfer(rhport, _iso.ep_out, _iso_epbuf.buf, PP_ISO_EP_SIZE);
+
+	return true;
+}
+
+static usbd_class_driver_t const pp_iso_driver = {
+#if CFG_TUSB_DEBUG >= 2
+	.name = "PP_ISO",
+#endif
+	.init = pp_iso_init,
+	.deinit = pp_iso_deinit,
+	.reset = pp_iso_reset,
+	.open = pp_iso_open,
+	.control_xfer_cb = pp_iso_control_xfer_cb,
+	.xfer_cb = pp_iso_xfer_cb,
+	.sof = NULL,
+};
+
+usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+	*driver_count = 1;
+	return &pp_iso_driver;
+}
@@ -0,0 +1,51 @@
+#ifndef _PP_ISO_H_
+#define _PP_ISO_H_
+
+#include <stdint.h>
+
+/**
+ * Optional isochronous frame stream.
+ *
+ * A vendor interface (subclass PP_ISO_SUBCLASS) whose alternate setting 1
+ * carries a single isochronous OUT endpoint. Selecting alt 1 reserves
+ * PP_ISO_EP_SIZE bytes of bus time in every 1ms USB frame, so delivery
+ * latency no longer depends on other traffic sharing the bus.
+ *
+ * Every packet starts with a pp_iso_pkt_hdr_t followed by payload bytes
+ * for the given channel. A channel frame is sent as consecutive packets
+ * with increasing offset and the same seq, and is output as soon as the
+ * last byte arrives. Packets are never retried, so a frame with a missing
+ * packet is dropped, as is a frame that arrives while the channel is
+ * still busy with the previous one.
+ */
+
+#ifndef PP_ISO_EP_SIZE
+#define PP_ISO_EP_SIZE 512
+#endif
+
+#define PP_ISO_SUBCLASS 0x01
+
+typedef struct __attribute__((packed)) {
+	uint8_t channel;
+	uint8_t seq;		/* Frame sequence number */
+	uint16_t offset;	/* Offset of this payload within the frame */
+	uint16_t len;		/* Total frame length */
+} pp_iso_pkt_hdr_t;
+
+#define PP_ISO_DESC_LEN (9 + 9 + 7)
+
+#define PP_ISO_DESCRIPTOR(_itfnum, _stridx, _epout, _epsize) \
+	/* Interface, alt 0: no endpoints, no bandwidth reserved */ \
+	9, TUSB_DESC_INTERFACE, _itfnum, 0, 0, \
+	TUSB_CLASS_VENDOR_SPECIFIC, PP_ISO_SUBCLASS, 0x00, _stridx, \
+	/* Interface, alt 1: isochronous OUT endpoint */ \
+	9, TUSB_DESC_INTERFACE, _itfnum, 1, 1, \
+	TUSB_CLASS_VENDOR_SPECIFIC, PP_ISO_SUBCLASS, 0x00, _stridx, \
+	/* Endpoint OUT, no synchronisation, one packet every frame */ \
+	7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_ISOCHRONOUS, \
+	U16_TO_U8S_LE(_epsize), 1
+
+/* Frames lost to a missing packet or a busy channel since boot */
+uint32_t pp_iso_dropped(void);
+
+#endif /* _PP_ISO_H_ */
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <tusb.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "pp_sched.h"
+
+static pp_job_t *pp_jobs[PP_SCHED_MAX_JOBS];
+static uint8_t pp_num_jobs;
+
+/* Count of pending jobs, lets the idle check avoid walking the table */
+static volatile uint8_t pp_jobs_pending;
+
+bool pp_sched_add(pp_job_t *job)
+{
+	if (pp_num_jobs >= PP_SCHED_MAX_JOBS) {
+		printf("No room for job %s\n", job->name);
+		return false;
+	}
+
+	job->pending = false;
+	pp_jobs[pp_num_jobs++] = job;
+
+	return true;
+}
+
+pp_job_t *pp_sched_job(uint8_t index)
+{
+	return index < pp_num_jobs ? pp_jobs[index] : NULL;
+}
+
+void pp_sched_post(pp_job_t *job, uint32_t deadline_us)
+{
+	absolute_time_t deadline = make_timeout_time_us(deadline_us);
+	uint32_t irq_state = save_and_disable_interrupts();
+
+	if (!job->pending) {
+		job->pending = true;
+		job->deadline = deadline;
+		pp_jobs_pending++;
+	} else if (absolute_time_diff_us(deadline, job->deadline) > 0) {
+		job->deadline = deadline;
+	}
+
+	restore_interrupts(irq_state);
+
+	/* Wake the main loop if it is waiting in pp_sched_run */
+	__sev();
+}
+
+/* Pick the highest priority pending job, earliest deadline first within
+ * a priority, and take it off the pending set. */
+static pp_job_t *pp_sched_next(void)
+{
+	pp_job_t *best = NULL;
+	pp_job_t *job;
+	uint32_t irq_state;
+	uint8_t i;
+
+	if (!pp_jobs_pending)
+		return NULL;
+
+	irq_state = save_and_disable_interrupts();
+
+	for (i = 0; i < pp_num_jobs; i++) {
+		job = pp_jobs[i];
+		if (!job->pending)
+			continue;
+
+		if (best == NULL || job->priority < best->priority ||
+		    (job->priority == best->priority &&
+		     absolute_time_diff_us(job->deadline, best->deadline) > 0))
+			best = job;
+	}
+
+	/* Cleared before running so the job can re-post itself */
+	if (best) {
+		best->pending = false;
+		pp_jobs_pending--;
+	}
+
+	restore_interrupts(irq_state);
+
+	return best;
+}
+
+static void pp_sched_exec(pp_job_t *job)
+{
+	absolute_time_t start = get_absolute_time();
+	uint32_t elapsed;
+
+	if (absolute_time_diff_us(job->deadline, start) > 0)
+		job->stats.late++;
+
+	job->fn(job->arg);
+
+	elapsed = (uint32_t)absolute_time_diff_us(start, get_absolute_time());
+	job->stats.runs++;
+	job->stats.total_us += elapsed;
+	if (elapsed > job->stats.max_us)
+		job->stats.max_us = elapsed;
+}
+
+void pp_sched_run(void)
+{
+	pp_job_t *job;
+
+	while (1) {
+		/* USB always goes first */
+		tud_task();
+
+		job = pp_sched_next();
+		if (job) {
+			pp_sched_exec(job);
+			continue;
+		}
+
+		/* Nothing to do, sleep until an interrupt queues a USB event
+		 * or posts a job. An interrupt landing between these checks
+		 * and the WFE sets the event register, so it is not missed. */
+		if (!tud_task_event_ready() && !pp_jobs_pending)
+			__wfe();
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef _PP_SCHED_H_
+#define _PP_SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/time.h"
+
+/**
+ * Cooperative run-to-completion scheduler for core0.
+ *
+ * tud_task() is serviced before every job, so USB response time is only
+ * ever delayed by a single job. Jobs must therefore do a bounded amount
+ * of work per call and re-post themselves if there is more to do.
+ */
+
+#define PP_SCHED_MAX_JOBS 8
+
+typedef void (*pp_job_fn_t)(void *arg);
+
+typedef struct {
+	uint32_t runs;
+	uint32_t late;		/* Runs that started after their deadline */
+	uint32_t max_us;
+	uint64_t total_us;
+} pp_job_stats_t;
+
+typedef struct {
+	const char *name;
+	pp_job_fn_t fn;
+	void *arg;
+	uint8_t priority;	/* Lower value runs first */
+
+	/* Owned by the scheduler */
+	volatile bool pending;
+	absolute_time_t deadline;
+	pp_job_stats_t stats;
+} pp_job_t;
+
+bool pp_sched_add(pp_job_t *job);
+
+/* The index'th job added, or NULL past the last one */
+pp_job_t *pp_sched_job(uint8_t index);
+
+/* Mark a job runnable, to be started within deadline_us. Safe to call
+ * from interrupt context. Posting an already pending job only brings its
+ * deadline forward. */
+void pp_sched_post(pp_job_t *job, uint32_t deadline_us);
+
+void pp_sched_run(void) __attribute__((noreturn));
+
+#endif /* _PP_SCHED_H_ */
@@ -12,7 +12,8 @@
 #endif
 
 #define CFG_TUD_ENABLED         (1)
-#define CFG_TUD_VENDOR          (1)
+// One vendor interface per channel group, each with its own bulk endpoints
+#define CFG_TUD_VENDOR          (4)
 
 // Legacy RHPORT configuration
 #define CFG_TUSB_RHPORT0_MODE   (OPT_MODE_DEVICE | OPT_MODE_FULL_SPEED)
@@ -7,6 +7,12 @@
 #include <tusb.h>
 #include <bsp/board_api.h>
 
+#include "pixelpusher.h"
+
+#if PP_ISO_STREAM
+#include "pp_iso.h"
+#endif
+
 // set some example Vendor and Product ID
 // the board will use to identify at the host
 #define VENDOR_EXAMPLE_VID     0xCAFE
@@ -40,19 +46,48 @@ tusb_desc_device_t const desc_device = {
 // called when host requests to get device descriptor
 uint8_t const *tud_descriptor_device_cb(void);
 
+// one vendor interface per channel group, plus the optional iso stream
+#if PP_ISO_STREAM
+#define ITF_NUM_ISO   CFG_TUD_VENDOR
+#define ITF_NUM_TOTAL (CFG_TUD_VENDOR + 1)
+#define ISO_DESC_LEN  PP_ISO_DESC_LEN
+#else
+#define ITF_NUM_TOTAL CFG_TUD_VENDOR
+#define ISO_DESC_LEN  0
+#endif
+
 // total length of configuration descriptor
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_VENDOR_DESC_LEN)
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + CFG_TUD_VENDOR * TUD_VENDOR_DESC_LEN + ISO_DESC_LEN)
 
-// define endpoint numbers
-#define EPNUM_VENDOR_0_OUT     0x01
-#define EPNUM_VENDOR_0_IN      0x81
+// define endpoint numbers, vendor interface n uses OUT 0x01 + n and IN 0x81 + n
+#define EPNUM_VENDOR_OUT(n)    PP_EP_VENDOR_OUT(n)
+#define EPNUM_VENDOR_IN(n)     (0x81 + (n))
+#define EPNUM_ISO_OUT          0x08
 
-#define ITF_NUM_TOTAL 1
+// all interfaces share string 4 so the host can find every group by name
+#define VENDOR_DESCRIPTOR(n) \
+    TUD_VENDOR_DESCRIPTOR(n, 4, EPNUM_VENDOR_OUT(n), EPNUM_VENDOR_IN(n), 64)
+
+#if CFG_TUD_VENDOR < 1 || CFG_TUD_VENDOR > 4
+#error "Descriptor table supports between 1 and 4 vendor interfaces"
+#endif
 
 uint8_t const desc_configuration[] = {
     // config descriptor | how much power in mA, count of interfaces, ...
     TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x80, 100),
-    TUD_VENDOR_DESCRIPTOR(0, 4, EPNUM_VENDOR_0_OUT, EPNUM_VENDOR_0_IN, 64),
+    VENDOR_DESCRIPTOR(0),
+#if CFG_TUD_VENDOR > 1
+    VENDOR_DESCRIPTOR(1),
+#endif
+#if CFG_TUD_VENDOR > 2
+    VENDOR_DESCRIPTOR(2),
+#endif
+#if CFG_TUD_VENDOR > 3
+    VENDOR_DESCRIPTOR(3),
+#endif
+#if PP_ISO_STREAM
+    PP_ISO_DESCRIPTOR(ITF_NUM_ISO, 6, EPNUM_ISO_OUT, PP_ISO_EP_SIZE),
+#endif
 };
 
 // called when host requests to get configuration descriptor
@@ -93,7 +128,8 @@ char const *string_desc_arr[] = {
     "Pico (2)",                     // 2: Product
     NULL,                           // 3: Serials (null so it uses unique ID if available)
     "WIPPv1",                       // 4: Vendor Interface 0
-    "RPiReset"                      // 6: Reset Interface
+    "RPiReset",                     // 5: Reset Interface
+    "WIPPv1-ISO"                    // 6: Isochronous Stream Interface
 };
 
 // buffer to hold the string descriptor during the request | plus 1 for the null terminator
@@ -130,8 +166,6 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
     (void) langid;
     size_t char_count;
 
-	printf("Descriptor string callback, index %d\n", index);
-
     // Determine which string descriptor to return
     switch (index) {
         case STRID_LANGID:
@@ -163,8 +197,6 @@ uint16_t const *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
                 char_count = max_count;
             }
 
-			printf("Returning string '%s'\n", str);
-
             // Convert ASCII string into UTF-16
             for (size_t i = 0; i < char_count; i++) {
                 _desc_str[1 + i] = str[i];
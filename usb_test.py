@@ -7,6 +7,8 @@ import threading
 import time
 import struct
 import argparse
+import random
+import resource
 from itertools import islice
 
 # Userspace application for communicating with the 
@@ -27,6 +29,365 @@ REQ_REST_VALUE = 0x16
 #portmap = { 1 : 1, 2 : 0 }
 portmap = { 2 : 1, 4 : 0 }
 
+# Pixelpusher vendor requests
+PP_REQ_CFG_CHAN = 0x1
+PP_REQ_GET_STATS = 0x2
+PP_REQ_GET_CHAN_STATS = 0x5
+PP_REQ_GET_BOOT_TIMES = 0x6
+PP_REQ_GET_JOB_STATS = 0x7
+PP_SCHED_MAX_JOBS = 8
+
+# Channel byte flags for range-patch writes
+PP_CHAN_INDEX_MASK = 0x3f
+PP_CHAN_DEFER = 0x40
+PP_CHAN_PATCH = 0x80
+
+# Iso stream packets carry a pp_iso_pkt_hdr_t: channel, seq, offset, len
+PP_ISO_EP_SIZE = 512
+PP_ISO_HDR = '<BBHH'
+
+PP_CHANNELS = 8
+PIXDATA_BUFSZ = 4096
+FORMAT_BPP = { 1 : 3, 2 : 4 }
+
+# Command line options, set in main()
+options = None
+
+def stream_group(endpt, chans, pixels, group, stop_event):
+    val = 0
+    start_ms = time.time() * 1000
+    while not stop_event.is_set():
+        val += 1
+        if val > 255:
+            val = 0
+            end_ms = time.time() * 1000
+            delta_ms = end_ms - start_ms
+            start_ms = end_ms
+            print(f'Group {group} FPS: {255 / (delta_ms / 1000)}')
+
+        data = [ val ] * pixels * 3
+        for i in chans:
+            hdr = [i]
+            buf = hdr + data
+            endpt.write(bytes(buf))
+
+def read_stats(dev, ifnum):
+    keys = ('frames', 'rx_errors', 'alarm_failures', 'sem_errors', 'max_wait_us', 'iso_dropped')
+    data = dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE | usb.ENDPOINT_IN,
+                             PP_REQ_GET_STATS, 0, ifnum, 4 * len(keys))
+    return dict(zip(keys, struct.unpack(f'<{len(keys)}L', bytes(data))))
+
+def read_chan_stats(dev, ifnum, chan):
+    keys = ('frames', 'underruns', 'retransmits')
+    data = dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE | usb.ENDPOINT_IN,
+                             PP_REQ_GET_CHAN_STATS, chan, ifnum, 4 * len(keys))
+    return dict(zip(keys, struct.unpack(f'<{len(keys)}L', bytes(data))))
+
+def read_boot_times(dev, ifnum):
+    keys = ('main_us', 'usb_init_us', 'boot_chans_us', 'mounted_us',
+            'first_cfg_us', 'first_frame_us')
+    data = dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE | usb.ENDPOINT_IN,
+                             PP_REQ_GET_BOOT_TIMES, 0, ifnum, 4 * len(keys))
+    return dict(zip(keys, struct.unpack(f'<{len(keys)}L', bytes(data))))
+
+def read_job_stats(dev, ifnum):
+    # One request per job, the device stalls past the last one
+    keys = ('runs', 'late', 'max_us', 'total_us')
+    jobs = {}
+    for i in range(PP_SCHED_MAX_JOBS):
+        try:
+            data = dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE | usb.ENDPOINT_IN,
+                                     PP_REQ_GET_JOB_STATS, i, ifnum, 32)
+        except usb.core.USBError:
+            break
+        name, *vals = struct.unpack('<12s3LQ', bytes(data))
+        jobs[name.rstrip(b'\0').decode()] = dict(zip(keys, vals))
+    return jobs
+
+def percentile(samples, p):
+    if not samples:
+        return 0
+    samples = sorted(samples)
+    return samples[min(len(samples) - 1, int(len(samples) * p / 100))]
+
+class DirtyChannel:
+    # Host copy of one channel's pixels that only sends what changed.
+    # Writes record dirty byte ranges, kept sorted and disjoint, and ranges
+    # within `coalesce` bytes of each other are merged since one slightly
+    # larger patch is cheaper than another USB transfer. flush() sends a
+    # range patch per dirty range, or the whole frame when more than
+    # `full_ratio` of it is dirty.
+    #
+    # A write that is a whole number of max size packets has no short
+    # packet to end it, and the device would merge it with the next one,
+    # so flush() never sends a write of that size.
+
+    def __init__(self, endpt, channel, pixels, bpp=3, coalesce=64, full_ratio=0.5):
+        self.endpt = endpt
+        self.max_packet = endpt.wMaxPacketSize
+        self.channel = channel
+        self.bpp = bpp
+        self.coalesce = coalesce
+        self.full_ratio = full_ratio
+        self.buf = bytearray(pixels * bpp)
+        self.dirty = []
+        self.sent = 0
+
+    def _mark(self, start, end):
+        # Patches have to start on a pixel
+        start -= start % self.bpp
+        kept = []
+        for s, e in self.dirty:
+            if e + self.coalesce < start or end + self.coalesce < s:
+                kept.append((s, e))
+            else:
+                start, end = min(s, start), max(e, end)
+        kept.append((start, end))
+        self.dirty = sorted(kept)
+
+    def set_range(self, first, colours):
+        # Set consecutive pixels from first to the given colour tuples
+        data = b''.join(bytes(c) for c in colours)
+        self.blit(first, data)
+
+    def fill(self, first, count, colour):
+        self.blit(first, bytes(colour) * count)
+
+    def blit(self, first, data):
+        # Copy raw pixel bytes in, starting at pixel first
+        start = first * self.bpp
+        end = min(start + len(data), len(self.buf))
+        if end <= start:
+            return
+        self.buf[start:end] = data[:end - start]
+        self._mark(start, end)
+
+    def _fit(self, s, e):
+        # Widen a patch that would be a whole number of packets by a
+        # pixel, or split its first pixel off when it already covers
+        # the whole frame
+        if (3 + e - s) % self.max_packet:
+            return [(s, e)]
+        if e + self.bpp <= len(self.buf):
+            return [(s, e + self.bpp)]
+        if s >= self.bpp:
+            return [(s - self.bpp, e)]
+        return [(s, s + self.bpp), (s + self.bpp, e)]
+
+    def flush(self):
+        if not self.dirty:
+            return
+        if sum(e - s for s, e in self.dirty) > self.full_ratio * len(self.buf):
+            if (1 + len(self.buf)) % self.max_packet:
+                writes = [bytes([self.channel]) + self.buf]
+            else:
+                # Two bytes longer as a patch of the whole frame
+                writes = [struct.pack('<BH', self.channel | PP_CHAN_PATCH, 0) + self.buf]
+        else:
+            # Only the last patch outputs the frame
+            ranges = [r for s, e in self.dirty for r in self._fit(s, e)]
+            writes = [struct.pack('<BH', self.channel | PP_CHAN_PATCH | PP_CHAN_DEFER, s) +
+                      self.buf[s:e] for s, e in ranges]
+            writes[-1] = bytes([writes[-1][0] & ~PP_CHAN_DEFER]) + writes[-1][1:]
+        for w in writes:
+            self.endpt.write(w)
+            self.sent += len(w)
+        self.dirty = []
+
+def sparse(dev, ifnum, endpts, lit, stop_event):
+    # Chase `lit` pixels along every channel, sending only what moved,
+    # and report USB bytes sent against full frames
+    pixels = 300
+    per_group = PP_CHANNELS // len(endpts)
+    chans = []
+    for c in range(PP_CHANNELS):
+        dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, PP_REQ_CFG_CHAN, 0, ifnum,
+                          struct.pack("<BBHB", c, 1, pixels, 0))
+        chans.append(DirtyChannel(endpts[c // per_group], c, pixels))
+
+    for ch in chans:
+        ch.fill(0, pixels, (0, 0, 0))
+        ch.flush()
+        ch.sent = 0
+
+    frames = 0
+    pos = 0
+    last = time.time()
+    while not stop_event.is_set():
+        for ch in chans:
+            for n in range(lit):
+                ch.fill((pos + n * pixels // lit) % pixels, 1, (0, 0, 0))
+                ch.fill((pos + n * pixels // lit + 1) % pixels, 1, (255, 255, 255))
+            ch.flush()
+        pos = (pos + 1) % pixels
+        frames += 1
+
+        now = time.time()
+        if now - last >= 1:
+            sent = sum(ch.sent for ch in chans)
+            full = frames * PP_CHANNELS * (pixels * 3 + 1)
+            print(f'{frames / (now - last):.1f} FPS, sent {sent} bytes, '
+                  f'{100 * sent / full:.1f}% of full frames')
+            for ch in chans:
+                ch.sent = 0
+            frames = 0
+            last = now
+
+def iso(dev, ifnum, iso_iface, pixels, stop_event):
+    # Stream frames to every channel over the isochronous interface, one
+    # packet per USB frame, splitting frames larger than a packet. The
+    # device drops frames with a missing packet or a busy channel, which
+    # GET_STATS reports as iso_dropped.
+    for c in range(PP_CHANNELS):
+        dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, PP_REQ_CFG_CHAN, 0, ifnum,
+                          struct.pack("<BBHB", c, 1, pixels, 0))
+
+    usb.util.claim_interface(dev, iso_iface)
+    dev.set_interface_altsetting(interface=iso_iface.bInterfaceNumber, alternate_setting=1)
+    endpt = iso_iface.endpoints()[0]
+    payload = PP_ISO_EP_SIZE - struct.calcsize(PP_ISO_HDR)
+
+    base = read_stats(dev, ifnum)
+    seq = val = frames = 0
+    last = time.time()
+    try:
+        while not stop_event.is_set():
+            data = bytes([val]) * pixels * 3
+            for c in range(PP_CHANNELS):
+                for off in range(0, len(data), payload):
+                    endpt.write(struct.pack(PP_ISO_HDR, c, seq, off, len(data)) +
+                                data[off:off + payload])
+            seq = (seq + 1) & 0xff
+            val = (val + 1) & 0xff
+            frames += PP_CHANNELS
+
+            now = time.time()
+            if now - last >= 1:
+                stats = read_stats(dev, ifnum)
+                print(f'Iso {frames / (now - last):.1f} channel frames/s, '
+                      f"latched {stats['frames'] - base['frames']}, "
+                      f"dropped {stats['iso_dropped'] - base['iso_dropped']}")
+                base = stats
+                frames = 0
+                last = now
+    finally:
+        # Give the bus time back
+        dev.set_interface_altsetting(interface=iso_iface.bInterfaceNumber, alternate_setting=0)
+
+def soak(dev, ifnum, endpts, seed, duration, report, stop_event):
+    # Randomised but reproducible traffic: the same seed replays the same
+    # sequence of reconfigurations, frames, bursts and invalid packets.
+    # Device counters are checked against what was sent at every report.
+    rng = random.Random(seed)
+    per_group = PP_CHANNELS // len(endpts)
+    chans = {}
+    sent = bad = violations = 0
+    lat = []
+
+    # A write that is a whole number of max size packets has no short
+    # packet to end it, and the device would merge it with the next one.
+    # Frame sizes like that are excluded here rather than followed by a
+    # zero length packet, which the device would count as an rx error.
+    max_packet = endpts[0].wMaxPacketSize
+
+    def configure(c, fmt):
+        pixels = rng.randint(1, PIXDATA_BUFSZ // FORMAT_BPP.get(fmt, 3))
+        while (pixels * FORMAT_BPP.get(fmt, 3) + 1) % max_packet == 0:
+            pixels -= 1
+        dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, PP_REQ_CFG_CHAN, 0, ifnum,
+                          struct.pack("<BBHB", c, fmt, pixels, rng.randrange(6)))
+        if fmt:
+            chans[c] = pixels * FORMAT_BPP[fmt]
+        else:
+            chans.pop(c, None)
+
+    def write(endpt, buf):
+        t0 = time.perf_counter()
+        endpt.write(buf)
+        lat.append((time.perf_counter() - t0) * 1000)
+
+    def frame(c):
+        write(endpts[c // per_group], bytes([c]) + rng.randbytes(chans[c]))
+
+    for c in range(PP_CHANNELS):
+        configure(c, rng.choice([1, 2]))
+
+    base = read_stats(dev, ifnum)
+    start = last = time.time()
+
+    while not stop_event.is_set() and time.time() - start < duration:
+        r = rng.random()
+        c = rng.randrange(PP_CHANNELS)
+
+        if r < 0.005:
+            # Reconfigure, occasionally removing the channel altogether
+            configure(c, rng.choice([0, 1, 1, 2, 2]))
+        elif r < 0.02:
+            # Invalid packet, every one of these must be rejected
+            kind = rng.randrange(4)
+            endpt = endpts[c // per_group]
+            if kind == 0:
+                # Out of range index with no patch or defer flags set
+                buf = bytes([rng.randint(PP_CHANNELS, PP_CHAN_INDEX_MASK)]) + bytes(16)
+            elif kind == 1 and len(endpts) > 1:
+                endpt = endpts[(c // per_group + 1) % len(endpts)]
+                buf = bytes([c]) + bytes(16)
+            elif kind == 2:
+                buf = bytes([c]) + bytes(PIXDATA_BUFSZ + 1)
+            else:
+                buf = bytes([c])
+            write(endpt, buf)
+            bad += 1
+        elif c in chans:
+            # Single frame, or a burst back to back
+            n = rng.randint(8, 64) if r < 0.05 else 1
+            for i in range(n):
+                frame(c)
+            sent += n
+
+        now = time.time()
+        if now - last < report:
+            continue
+        last = now
+
+        stats = read_stats(dev, ifnum)
+        frames = stats['frames'] - base['frames']
+        errors = stats['rx_errors'] - base['rx_errors']
+
+        problems = []
+        if stats['sem_errors'] != base['sem_errors']:
+            problems.append(f"sem_errors {stats['sem_errors']}")
+        if stats['alarm_failures'] != base['alarm_failures']:
+            problems.append(f"alarm_failures {stats['alarm_failures']}")
+        if errors != bad:
+            problems.append(f'rx_errors {errors} != invalid packets sent {bad}')
+        # Up to one frame per channel can still be latching
+        if not 0 <= sent - frames <= PP_CHANNELS:
+            problems.append(f'frames latched {frames} != frames sent {sent}')
+        violations += len(problems)
+
+        print(f'[{now - start:9.0f}s] sent {sent} latched {frames} '
+              f'write ms p50 {percentile(lat, 50):.2f} p99 {percentile(lat, 99):.2f} '
+              f'p99.9 {percentile(lat, 99.9):.2f} max {max(lat, default=0):.2f} '
+              f"device max wait us {stats['max_wait_us']} "
+              f'host rss kB {resource.getrusage(resource.RUSAGE_SELF).ru_maxrss}')
+        for p in problems:
+            print(f'  VIOLATION: {p}')
+
+        # PIO FIFO underruns show the device falling behind under bus load
+        for c in range(PP_CHANNELS):
+            cs = read_chan_stats(dev, ifnum, c)
+            if cs['underruns']:
+                print(f"  channel {c} underruns {cs['underruns']} retransmits {cs['retransmits']}")
+
+        # Every job delays tud_task() by up to its longest run
+        for name, js in read_job_stats(dev, ifnum).items():
+            print(f"  job {name} runs {js['runs']} late {js['late']} "
+                  f"max us {js['max_us']} avg us {js['total_us'] // max(js['runs'], 1)}")
+        lat = []
+
+    print(f'Soak seed {seed} finished: {sent} frames, {bad} invalid packets, {violations} violations')
+
 def handle_device(context, _device, stop_event):
 
     print(f'Handling device {_device} on port {_device.getPortNumber()}')
@@ -37,8 +398,8 @@ def handle_device(context, _device, stop_event):
         return
 
     dev = None
-    iface = None
-    ifnum = None
+    ifaces = []
+    iso_iface = None
     port = _device.getPortNumber()
 
     # Find specific pyusb controller, matching device bus and address to the libusb1 hotplug event
@@ -47,50 +408,70 @@ def handle_device(context, _device, stop_event):
             for cfg in device:
                 for interface in cfg:
                     # Vendor and product ID are generic, so we have a specific named interface to look for
-                    print(f'Interface name {usb.util.get_string(device, interface.iInterface)}')
-                    if usb.util.get_string(device, interface.iInterface) == 'WIPPv1':
+                    name = usb.util.get_string(device, interface.iInterface)
+                    print(f'Interface name {name}')
+                    # Each channel group has its own interface, all sharing the same name
+                    if name == 'WIPPv1':
                         dev = device
-                        iface = interface
-                        ifnum = interface.bInterfaceNumber
+                        ifaces.append(interface)
+                    # Only alt 1 of the iso interface has the endpoint
+                    elif name == 'WIPPv1-ISO' and interface.bAlternateSetting == 1:
+                        iso_iface = interface
 
     if dev is None:
         return
 
-    try:
-        usb.util.claim_interface(dev, iface)
-    except usb.core.USBError as e:
-        print("Error occurred claiming " + str(e))
-        return
+    ifaces.sort(key=lambda i: i.bInterfaceNumber)
+    ifnum = ifaces[0].bInterfaceNumber
+
+    for iface in ifaces:
+        try:
+            usb.util.claim_interface(dev, iface)
+        except usb.core.USBError as e:
+            print("Error occurred claiming " + str(e))
+            return
+
+    # Phases not reached yet read as 0
+    boot = read_boot_times(dev, ifnum)
+    print('Boot times ms: ' + ' '.join(f'{k[:-3]} {v / 1000:.1f}' for k, v in boot.items()))
 
     pixels = 12
+    order = 0   # PP_ORDER_RGB, strip takes components in the order sent
 
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",0,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",1,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",2,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",3,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",4,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",5,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",6,1,pixels))
-    dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBH",7,1,pixels))
+    if options.soak is not None:
+        soak(dev, ifnum, [iface.endpoints()[0] for iface in ifaces],
+             options.soak, options.duration, options.report, stop_event)
+        return
 
-    endpt = iface.endpoints()[0]
+    if options.iso is not None:
+        if iso_iface is None:
+            print('No iso interface, firmware needs building with PP_ISO_STREAM')
+            return
+        iso(dev, ifnum, iso_iface, options.iso, stop_event)
+        return
 
-    val = 0
-    start_ms = time.time() * 1000
-    while True:
-        val += 1
-        if val > 255:
-            val = 0
-            end_ms = time.time() * 1000
-            delta_ms = end_ms - start_ms
-            start_ms = end_ms
-            print(f'FPS: {255 / (delta_ms / 1000)}')
+    if options.sparse is not None:
+        sparse(dev, ifnum, [iface.endpoints()[0] for iface in ifaces],
+               options.sparse, stop_event)
+        return
 
-        data = [ val ] * pixels * 3
-        for i in range(8):
-            hdr = [i]
-            buf = hdr + data
-            endpt.write(bytes(buf))
+    for i in range(8):
+        dev.ctrl_transfer(usb.TYPE_VENDOR | usb.RECIP_INTERFACE, 1, 0, ifnum, struct.pack("<BBHB",i,1,pixels,order))
+
+    # Channels are split evenly between the interfaces, stream to each
+    # group from its own thread so one group never waits on another
+    channels = 8
+    per_group = channels // len(ifaces)
+    groups = []
+    for n, iface in enumerate(ifaces):
+        endpt = iface.endpoints()[0]
+        chans = range(n * per_group, (n + 1) * per_group)
+        t = threading.Thread(target=stream_group, args=(endpt, chans, pixels, n, stop_event))
+        groups.append(t)
+        t.start()
+
+    for t in groups:
+        t.join()
 
     #for i in range(0, 10):
         #endpt.write(jim)
@@ -153,8 +534,20 @@ def hotplug_callback(context, device, event):
         t.join()
 
 def main():
+    global options
+
     parser = argparse.ArgumentParser()
-    args = parser.parse_args()
+    parser.add_argument('--soak', type=int, metavar='SEED',
+                        help='run randomised soak traffic from SEED instead of the FPS test')
+    parser.add_argument('--duration', type=float, default=24 * 3600,
+                        help='soak duration in seconds')
+    parser.add_argument('--report', type=float, default=60,
+                        help='seconds between soak reports and invariant checks')
+    parser.add_argument('--sparse', type=int, metavar='LIT',
+                        help='chase LIT pixels per channel with range-patch writes')
+    parser.add_argument('--iso', type=int, metavar='PIXELS',
+                        help='stream PIXELS per channel over the isochronous interface')
+    options = parser.parse_args()
 
     with usb1.USBContext() as context:
         if not context.hasCapability(usb1.CAP_HAS_HOTPLUG):